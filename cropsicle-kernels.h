@@ -0,0 +1,296 @@
+/* -*- Mode: C; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+
+/* cropsicle-kernels.h - Per-pixel kernels, compiled for several ISA levels
+ *
+ * Copyright (C) 2014 Hans Petter Jansson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors: Hans Petter Jansson <hpj@copyleft.no>
+ */
+
+/* This file is included by cropsicle.c once per instruction set, each time
+ * under a different #pragma GCC target, with the following defined:
+ *
+ *   KERNEL_ISA       Appended to the names of the functions defined here
+ *   KERNEL_ISA_NAME  Name of the instruction set, for --isa
+ *
+ * It defines a KernelSet named kernel_set_<KERNEL_ISA>.
+ *
+ * The kernels are written so the compiler can vectorize them: the common
+ * case, a pixel with all its neighbors present, runs in a loop of its own
+ * without branches. They must give the same results on every instruction
+ * set, so they do the same float operations in the same order as the general
+ * case, and must not be contracted into fused multiply-adds.
+ *
+ * Only finite values pass through here, and the file is compiled with
+ * finite-math-only. That tells the compiler the sum of squares in
+ * edge_weight () can't be negative, so sqrtf () needs no errno handling and
+ * is vectorized. */
+
+#define KERNEL_NAME_2(name, isa) name ## _ ## isa
+#define KERNEL_NAME_1(name, isa) KERNEL_NAME_2 (name, isa)
+#define KERNEL_NAME(name) KERNEL_NAME_1 (name, KERNEL_ISA)
+
+/* The preprocessing steps work on single rows so they can be streamed. Each
+ * takes the rows above and below the one it's working on, NULL at the image
+ * border. Colour rows are planar; see colour_plane_width (). */
+
+/* Dividing in float gives the same results as in double for all 256 inputs,
+ * and takes half as many vector lanes */
+static void
+KERNEL_NAME (image_row_to_array) (const Image *image, int y, float *out)
+{
+  const png_byte *row = image->rows [y];
+  int stride = colour_plane_width (image->width);
+  float *red = out, *green = out + stride, *blue = out + 2 * stride;
+  int x;
+
+  for (x = 0; x < image->width; x++)
+  {
+    red [x]   = (float) row [x * 4] / 255.0f;
+    green [x] = (float) row [x * 4 + 1] / 255.0f;
+    blue [x]  = (float) row [x * 4 + 2] / 255.0f;
+  }
+}
+
+static inline void
+KERNEL_NAME (blur_pixel) (int width, const float * const *rows, int x, float *out)
+{
+  const int nx9 [9] = { 0, -1,  0,  1, -1, 1, -1, 0, 1 };
+  const int ny9 [9] = { 0, -1, -1, -1,  0, 0,  1, 1, 1 };
+  int stride = colour_plane_width (width);
+  float sum [3] = { 0.0, 0.0, 0.0 };
+  int n_pixels = 0;
+  int i, c;
+
+  for (i = 0; i < 9; i++)
+  {
+    const float *neighbor;
+
+    if (x + nx9 [i] < 0 || x + nx9 [i] >= width || !rows [ny9 [i] + 1])
+      continue;
+
+    neighbor = rows [ny9 [i] + 1] + x + nx9 [i];
+
+    for (c = 0; c < 3; c++)
+      sum [c] += neighbor [c * stride];
+    n_pixels++;
+  }
+
+  for (c = 0; c < 3; c++)
+    out [c * stride + x] = sum [c] / (float) n_pixels;
+}
+
+static void
+KERNEL_NAME (blur_row) (int width, const float *above, const float *row, const float *below, float *out)
+{
+  int stride = colour_plane_width (width);
+  const float *rows [3];
+  int x, c;
+
+  rows [0] = above;
+  rows [1] = row;
+  rows [2] = below;
+
+  if (!above || !below || width < 3)
+  {
+    for (x = 0; x < width; x++)
+      KERNEL_NAME (blur_pixel) (width, rows, x, out);
+    return;
+  }
+
+  KERNEL_NAME (blur_pixel) (width, rows, 0, out);
+
+  /* All nine present; summed in the same order as above */
+
+  for (c = 0; c < 3; c++)
+  {
+    const float *a = above + c * stride, *r = row + c * stride, *b = below + c * stride;
+    float *o = out + c * stride;
+
+    for (x = 1; x < width - 1; x++)
+    {
+      float sum = 0.0;
+
+      sum += r [x];
+      sum += a [x - 1];
+      sum += a [x];
+      sum += a [x + 1];
+      sum += r [x - 1];
+      sum += r [x + 1];
+      sum += b [x - 1];
+      sum += b [x];
+      sum += b [x + 1];
+
+      o [x] = sum / 9.0f;
+    }
+  }
+
+  KERNEL_NAME (blur_pixel) (width, rows, width - 1, out);
+}
+
+static inline float
+KERNEL_NAME (edge_weight) (const float *pixel, const float *neighbor, int stride)
+{
+  const float maxC = 1.732050808;
+  float dr = pixel [0] - neighbor [0];
+  float dg = pixel [stride] - neighbor [stride];
+  float db = pixel [2 * stride] - neighbor [2 * stride];
+  float C;
+
+  C = sqrtf (dr * dr + dg * dg + db * db);
+  return 1.0 - (C / maxC);
+}
+
+static inline void
+KERNEL_NAME (calc_g_pixel) (int width, const float * const *rows, int x, float *g_row)
+{
+  int stride = colour_plane_width (width);
+  int i;
+
+  for (i = 0; i < 8; i++)
+  {
+    if (x + nx8 [i] < 0 || x + nx8 [i] >= width || !rows [ny8 [i] + 1])
+    {
+      g_row [x * 8 + i] = 0.0;
+      continue;
+    }
+
+    g_row [x * 8 + i] = KERNEL_NAME (edge_weight) (rows [1] + x, rows [ny8 [i] + 1] + x + nx8 [i], stride);
+  }
+}
+
+static void
+KERNEL_NAME (calc_g_row) (int width, const float *above, const float *row, const float *below, float *g_row)
+{
+  int stride = colour_plane_width (width);
+  const float *rows [3];
+  int x, x0, i;
+
+  rows [0] = above;
+  rows [1] = row;
+  rows [2] = below;
+
+  if (!above || !below || width < 3)
+  {
+    for (x = 0; x < width; x++)
+      KERNEL_NAME (calc_g_pixel) (width, rows, x, g_row);
+    return;
+  }
+
+  KERNEL_NAME (calc_g_pixel) (width, rows, 0, g_row);
+
+  /* Each direction is done over a block of pixels with unit stride, then
+   * the block is interleaved into g_row */
+
+  for (x0 = 1; x0 < width - 1; x0 += CALC_G_BLOCK)
+  {
+    float block [8] [CALC_G_BLOCK];
+    int n = width - 1 - x0 < CALC_G_BLOCK ? width - 1 - x0 : CALC_G_BLOCK;
+
+    for (i = 0; i < 8; i++)
+    {
+      const float *neighbor = rows [ny8 [i] + 1] + x0 + nx8 [i];
+
+      for (x = 0; x < n; x++)
+        block [i] [x] = KERNEL_NAME (edge_weight) (row + x0 + x, neighbor + x, stride);
+    }
+
+    for (x = 0; x < n; x++)
+    {
+      for (i = 0; i < 8; i++)
+        g_row [(x0 + x) * 8 + i] = block [i] [x];
+    }
+  }
+
+  KERNEL_NAME (calc_g_pixel) (width, rows, width - 1, g_row);
+}
+
+/* The update kernel, for each storage format */
+
+#define KERNEL_FORMAT fp32
+#define storage_t float
+#define LOAD(v) (v)
+#define STORE(f) ((float) (f))
+#include "cropsicle-update.h"
+#undef KERNEL_FORMAT
+#undef storage_t
+#undef LOAD
+#undef STORE
+
+#define KERNEL_FORMAT fp16
+#define storage_t uint16_t
+#define LOAD(v) fp16_to_float (v)
+#define STORE(f) float_to_fp16 (f)
+#include "cropsicle-update.h"
+#undef KERNEL_FORMAT
+#undef storage_t
+#undef LOAD
+#undef STORE
+
+#define KERNEL_FORMAT bf16
+#define storage_t uint16_t
+#define LOAD(v) bf16_to_float (v)
+#define STORE(f) float_to_bf16 (f)
+#include "cropsicle-update.h"
+#undef KERNEL_FORMAT
+#undef storage_t
+#undef LOAD
+#undef STORE
+
+#define FORMAT_NAME_2(name, format, isa) name ## _ ## format ## _ ## isa
+#define FORMAT_NAME_1(name, format, isa) FORMAT_NAME_2 (name, format, isa)
+#define FORMAT_NAME(name, format) FORMAT_NAME_1 (name, format, KERNEL_ISA)
+
+static const KernelSet KERNEL_NAME (kernel_set) =
+{
+  KERNEL_ISA_NAME,
+  KERNEL_NAME (image_row_to_array),
+  KERNEL_NAME (blur_row),
+  KERNEL_NAME (calc_g_row),
+  {
+    [PRECISION_FP32] = FORMAT_NAME (process_rows, fp32),
+    [PRECISION_FP16] = FORMAT_NAME (process_rows, fp16),
+    [PRECISION_BF16] = FORMAT_NAME (process_rows, bf16)
+  },
+  {
+    [PRECISION_FP32] = FORMAT_NAME (process_rows_sets, fp32),
+    [PRECISION_FP16] = FORMAT_NAME (process_rows_sets, fp16),
+    [PRECISION_BF16] = FORMAT_NAME (process_rows_sets, bf16)
+  },
+  {
+    [PRECISION_FP32] = FORMAT_NAME (process_block, fp32),
+    [PRECISION_FP16] = FORMAT_NAME (process_block, fp16),
+    [PRECISION_BF16] = FORMAT_NAME (process_block, bf16)
+  },
+  {
+    [PRECISION_FP32] = FORMAT_NAME (strength_to_alpha_row, fp32),
+    [PRECISION_FP16] = FORMAT_NAME (strength_to_alpha_row, fp16),
+    [PRECISION_BF16] = FORMAT_NAME (strength_to_alpha_row, bf16)
+  },
+  {
+    [PRECISION_FP32] = FORMAT_NAME (overlay_row_to_seeds, fp32),
+    [PRECISION_FP16] = FORMAT_NAME (overlay_row_to_seeds, fp16),
+    [PRECISION_BF16] = FORMAT_NAME (overlay_row_to_seeds, bf16)
+  }
+};
+
+#undef FORMAT_NAME
+#undef FORMAT_NAME_1
+#undef FORMAT_NAME_2
+
+#undef KERNEL_NAME
+#undef KERNEL_NAME_1
+#undef KERNEL_NAME_2
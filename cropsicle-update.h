@@ -0,0 +1,404 @@
+/* -*- Mode: C; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+
+/* cropsicle-update.h - GrowCut update kernel
+ *
+ * Copyright (C) 2014 Hans Petter Jansson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors: Hans Petter Jansson <hpj@copyleft.no>
+ */
+
+/* This file is included by cropsicle-kernels.h once for each storage format
+ * of the weight and strength arrays, with the following defined:
+ *
+ *   KERNEL_ISA     Instruction set suffix, see cropsicle-kernels.h
+ *   KERNEL_FORMAT  Storage format suffix
+ *   storage_t      Element type of the arrays
+ *   LOAD(v)        Converts a storage_t to float
+ *   STORE(f)       Converts a float to storage_t
+ *
+ * Arithmetic is always done in float, and the winning strength is rounded to
+ * the storage format once per cell. A cell only counts as changed if its
+ * stored value changes. Stored strengths only ever grow in magnitude, so the
+ * automaton still converges. In float, this is exactly the original rule. */
+
+#define UPDATE_NAME_2(name, format, isa) name ## _ ## format ## _ ## isa
+#define UPDATE_NAME_1(name, format, isa) UPDATE_NAME_2 (name, format, isa)
+#define UPDATE_NAME(name) UPDATE_NAME_1 (name, KERNEL_FORMAT, KERNEL_ISA)
+
+static inline void
+UPDATE_NAME (process_pixel_neighbor_border) (ptrdiff_t index, const storage_t *overlay_array_in, float *strength,
+                                             const storage_t *g_array, const int *neighbor_index_ofs, int i)
+{
+  ptrdiff_t neighbor_index = index + neighbor_index_ofs [i];
+  float g = LOAD (g_array [index * 8 + i]);
+  float attack = g * LOAD (overlay_array_in [neighbor_index]);
+
+  if (fabsf (attack) > fabsf (*strength))
+    *strength = attack;
+}
+
+/* Returns nonzero if the cell changed */
+static inline int
+UPDATE_NAME (process_pixel_border) (const Image *image, int x, int y, ptrdiff_t index,
+                                    const storage_t *overlay_array_in, storage_t *overlay_array_out,
+                                    const storage_t *g_array, const int *neighbor_index_ofs)
+{
+  float strength = LOAD (overlay_array_in [index]);
+  int i;
+
+  for (i = 0; i < 8; i++)
+  {
+    if (x + nx8 [i] < 0 || x + nx8 [i] >= image->width ||
+        y + ny8 [i] < 0 || y + ny8 [i] >= image->height)
+      continue;
+
+    UPDATE_NAME (process_pixel_neighbor_border) (index, overlay_array_in, &strength, g_array,
+                                                 neighbor_index_ofs, i);
+  }
+
+  overlay_array_out [index] = STORE (strength);
+  return overlay_array_out [index] != overlay_array_in [index];
+}
+
+/* Branchless, so the loop over a row vectorizes */
+static inline void
+UPDATE_NAME (process_pixel_neighbor_internal) (ptrdiff_t index, const storage_t *overlay_array_in, float *strength,
+                                               const storage_t *g_array, const int *neighbor_index_ofs, int i)
+{
+  ptrdiff_t neighbor_index = index + neighbor_index_ofs [i];
+  float g = LOAD (g_array [index * 8 + i]);
+  float attack = g * LOAD (overlay_array_in [neighbor_index]);
+
+  *strength = fabsf (attack) > fabsf (*strength) ? attack : *strength;
+}
+
+static inline int
+UPDATE_NAME (process_pixel_internal) (ptrdiff_t index, const storage_t *overlay_array_in, storage_t *overlay_array_out,
+                                      const storage_t *g_array, const int *neighbor_index_ofs)
+{
+  float strength = LOAD (overlay_array_in [index]);
+  int i;
+
+  for (i = 0; i < 8; i++)
+    UPDATE_NAME (process_pixel_neighbor_internal) (index, overlay_array_in, &strength, g_array,
+                                                   neighbor_index_ofs, i);
+
+  overlay_array_out [index] = STORE (strength);
+  return overlay_array_out [index] != overlay_array_in [index];
+}
+
+/* Processes rows [y0, y1) of arrays whose first row is image row row_base. All
+ * three arrays share the same layout, so the neighbor offsets still apply. */
+static void
+UPDATE_NAME (process_rows) (const Image *image, int y0, int y1, int row_base, const void *in,
+                            void *out, const void *g, const int *neighbor_index_ofs,
+                            int *converged)
+{
+  const storage_t *overlay_array_in = in;
+  storage_t *overlay_array_out = out;
+  const storage_t *g_array = g;
+  int width = image->width;
+  int changed = 0;
+  int x, y;
+
+  for (y = y0; y < y1; y++)
+  {
+    ptrdiff_t index = (ptrdiff_t) (y - row_base) * width;
+
+    if (y == 0 || y == image->height - 1 || width < 3)
+    {
+      for (x = 0; x < width; x++)
+        changed |= UPDATE_NAME (process_pixel_border) (image, x, y, index + x, overlay_array_in,
+                                                       overlay_array_out, g_array, neighbor_index_ofs);
+      continue;
+    }
+
+    changed |= UPDATE_NAME (process_pixel_border) (image, 0, y, index, overlay_array_in, overlay_array_out,
+                                                   g_array, neighbor_index_ofs);
+
+    for (x = 1; x < width - 1; x++)
+      changed |= UPDATE_NAME (process_pixel_internal) (index + x, overlay_array_in, overlay_array_out,
+                                                       g_array, neighbor_index_ofs);
+
+    changed |= UPDATE_NAME (process_pixel_border) (image, width - 1, y, index + width - 1, overlay_array_in,
+                                                   overlay_array_out, g_array, neighbor_index_ofs);
+  }
+
+  if (changed)
+    *converged = 0;
+}
+
+/* Like process_pixel_border () and process_pixel_internal (), for n_sets
+ * interleaved seed sets. A missing neighbor is given weight 0 and the
+ * pixel's own offset; its attack is then 0, which never wins, the same as
+ * skipping it. The loop over the sets, SEED_SET_LANES at a time, becomes
+ * whole vectors. */
+static inline int
+UPDATE_NAME (process_sets_pixel) (const Image *image, int x, int y, ptrdiff_t index, int n_sets,
+                                  const storage_t *overlay_array_in, storage_t *overlay_array_out,
+                                  const storage_t *g_array, const int *neighbor_index_ofs,
+                                  int border)
+{
+  ptrdiff_t ofs [8];
+  float g [8];
+  int changed = 0;
+  int i, k, k0;
+
+  for (i = 0; i < 8; i++)
+  {
+    g [i] = LOAD (g_array [index * 8 + i]);
+    ofs [i] = (ptrdiff_t) neighbor_index_ofs [i] * n_sets;
+
+    if (border && (x + nx8 [i] < 0 || x + nx8 [i] >= image->width ||
+                   y + ny8 [i] < 0 || y + ny8 [i] >= image->height))
+    {
+      g [i] = 0.0f;
+      ofs [i] = 0;
+    }
+  }
+
+  for (k0 = 0; k0 < n_sets; k0 += SEED_SET_LANES)
+  {
+    const storage_t *cell_in = overlay_array_in + index * n_sets + k0;
+    storage_t *cell_out = overlay_array_out + index * n_sets + k0;
+
+#pragma GCC ivdep
+    for (k = 0; k < SEED_SET_LANES; k++)
+    {
+      float strength = LOAD (cell_in [k]);
+
+      for (i = 0; i < 8; i++)
+      {
+        float attack = g [i] * LOAD (cell_in [ofs [i] + k]);
+
+        strength = fabsf (attack) > fabsf (strength) ? attack : strength;
+      }
+
+      cell_out [k] = STORE (strength);
+      changed |= cell_out [k] != cell_in [k];
+    }
+  }
+
+  return changed;
+}
+
+/* Like process_rows (), for n_sets seed sets solved at once, n_sets being a
+ * multiple of SEED_SET_LANES. The strengths are interleaved, n_sets to a
+ * pixel, so each weight is loaded once for a vector of sets. Each set sees
+ * the same operations in the same order as it would alone. */
+static void
+UPDATE_NAME (process_rows_sets) (const Image *image, int y0, int y1, int row_base, int n_sets,
+                                 const void *in, void *out, const void *g,
+                                 const int *neighbor_index_ofs, int *converged)
+{
+  const storage_t *overlay_array_in = in;
+  storage_t *overlay_array_out = out;
+  const storage_t *g_array = g;
+  int width = image->width;
+  int changed = 0;
+  int x, y;
+
+  for (y = y0; y < y1; y++)
+  {
+    ptrdiff_t index = (ptrdiff_t) (y - row_base) * width;
+
+    if (y == 0 || y == image->height - 1 || width < 3)
+    {
+      for (x = 0; x < width; x++)
+        changed |= UPDATE_NAME (process_sets_pixel) (image, x, y, index + x, n_sets, overlay_array_in,
+                                                     overlay_array_out, g_array, neighbor_index_ofs, 1);
+      continue;
+    }
+
+    changed |= UPDATE_NAME (process_sets_pixel) (image, 0, y, index, n_sets, overlay_array_in,
+                                                 overlay_array_out, g_array, neighbor_index_ofs, 1);
+
+    for (x = 1; x < width - 1; x++)
+      changed |= UPDATE_NAME (process_sets_pixel) (image, x, y, index + x, n_sets, overlay_array_in,
+                                                   overlay_array_out, g_array, neighbor_index_ofs, 0);
+
+    changed |= UPDATE_NAME (process_sets_pixel) (image, width - 1, y, index + width - 1, n_sets,
+                                                 overlay_array_in, overlay_array_out, g_array,
+                                                 neighbor_index_ofs, 1);
+  }
+
+  if (changed)
+    *converged = 0;
+}
+
+/* Like process_pixel_border (), for a cell on the edge of a block of a
+ * blocked layout. Neighbors in other blocks are looked up. */
+static inline int
+UPDATE_NAME (process_block_edge_pixel) (const Image *image, const Layout *layout, const Block *block,
+                                        int x, int y, ptrdiff_t index, const storage_t *overlay_array_in,
+                                        storage_t *overlay_array_out, const storage_t *g_array)
+{
+  float strength = LOAD (overlay_array_in [index]);
+  int i;
+
+  for (i = 0; i < 8; i++)
+  {
+    int neighbor_x = x + nx8 [i], neighbor_y = y + ny8 [i];
+    ptrdiff_t neighbor_index;
+    float attack;
+
+    if (neighbor_x < 0 || neighbor_x >= image->width ||
+        neighbor_y < 0 || neighbor_y >= image->height)
+      continue;
+
+    if (neighbor_x >= block->x0 && neighbor_x < block->x0 + block->width &&
+        neighbor_y >= block->y0 && neighbor_y < block->y0 + block->height)
+      neighbor_index = index + block->neighbor_index_ofs [i];
+    else
+      neighbor_index = layout_index (layout, neighbor_x, neighbor_y);
+
+    attack = LOAD (g_array [index * 8 + i]) * LOAD (overlay_array_in [neighbor_index]);
+    if (fabsf (attack) > fabsf (strength))
+      strength = attack;
+  }
+
+  overlay_array_out [index] = STORE (strength);
+  return overlay_array_out [index] != overlay_array_in [index];
+}
+
+/* Like process_rows (), for one block of a blocked layout. Its cells are in
+ * rows of its own width, so the ones inside it use the block's neighbor
+ * offsets and vectorize as in rows. The neighbors of its top and bottom rows
+ * in the blocks above and below are a fixed distance away along the row, so
+ * those rows do too, and the first and last cells of the other rows work out
+ * the offsets to the blocks beside them. Only the corners and cells on the
+ * edge of the image look their neighbors up. */
+static void
+UPDATE_NAME (process_block) (const Image *image, const Layout *layout, const Block *block,
+                             const void *in, void *out, const void *g, int *converged)
+{
+  const storage_t *overlay_array_in = in;
+  storage_t *overlay_array_out = out;
+  const storage_t *g_array = g;
+  const Block *above = layout_neighbor_block (layout, block, 0, -1);
+  const Block *below = layout_neighbor_block (layout, block, 0, 1);
+  const Block *left = layout_neighbor_block (layout, block, -1, 0);
+  const Block *right = layout_neighbor_block (layout, block, 1, 0);
+  int width = block->width, height = block->height;
+  int row_ofs [8], cell_ofs [8];
+  int changed = 0;
+  int x, y, i;
+
+  for (y = 0; y < height; y++)
+  {
+    ptrdiff_t index = block->base + (ptrdiff_t) y * width;
+    int inside = width >= 3;
+
+    for (i = 0; i < 8; i++)
+    {
+      row_ofs [i] = block->neighbor_index_ofs [i];
+
+      if (ny8 [i] < 0 && y == 0)
+      {
+        inside &= above != NULL;
+        if (above)
+          row_ofs [i] = above->base + (ptrdiff_t) (above->height - 1) * width + nx8 [i] - index;
+      }
+      else if (ny8 [i] > 0 && y == height - 1)
+      {
+        inside &= below != NULL;
+        if (below)
+          row_ofs [i] = below->base + nx8 [i] - index;
+      }
+    }
+
+    if (!inside)
+    {
+      for (x = 0; x < width; x++)
+        changed |= UPDATE_NAME (process_block_edge_pixel) (image, layout, block, block->x0 + x, block->y0 + y,
+                                                           index + x, overlay_array_in, overlay_array_out,
+                                                           g_array);
+      continue;
+    }
+
+    if (left && y > 0 && y < height - 1)
+    {
+      for (i = 0; i < 8; i++)
+        cell_ofs [i] = nx8 [i] < 0
+          ? left->base + (ptrdiff_t) (y + ny8 [i]) * left->width + left->width - 1 - index
+          : row_ofs [i];
+      changed |= UPDATE_NAME (process_pixel_internal) (index, overlay_array_in, overlay_array_out, g_array,
+                                                       cell_ofs);
+    }
+    else
+    {
+      changed |= UPDATE_NAME (process_block_edge_pixel) (image, layout, block, block->x0, block->y0 + y, index,
+                                                         overlay_array_in, overlay_array_out, g_array);
+    }
+
+    for (x = 1; x < width - 1; x++)
+      changed |= UPDATE_NAME (process_pixel_internal) (index + x, overlay_array_in, overlay_array_out,
+                                                       g_array, row_ofs);
+
+    if (right && y > 0 && y < height - 1)
+    {
+      for (i = 0; i < 8; i++)
+        cell_ofs [i] = nx8 [i] > 0
+          ? right->base + (ptrdiff_t) (y + ny8 [i]) * right->width - (index + width - 1)
+          : row_ofs [i];
+      changed |= UPDATE_NAME (process_pixel_internal) (index + width - 1, overlay_array_in, overlay_array_out,
+                                                       g_array, cell_ofs);
+    }
+    else
+    {
+      changed |= UPDATE_NAME (process_block_edge_pixel) (image, layout, block, block->x0 + width - 1,
+                                                         block->y0 + y, index + width - 1, overlay_array_in,
+                                                         overlay_array_out, g_array);
+    }
+  }
+
+  if (changed)
+    *converged = 0;
+}
+
+/* Hard alpha from the sign of the strengths */
+static void
+UPDATE_NAME (strength_to_alpha_row) (const void *strength, png_byte *row, int width)
+{
+  const storage_t *strength_row = strength;
+  int x;
+
+  for (x = 0; x < width; x++)
+    row [x * 4 + 3] = LOAD (strength_row [x]) > 0.0f ? 0xff : 0x00;
+}
+
+/* Seeds from the overlay: opaque pixels are foreground (+1) if green and
+ * background (-1) if red, the rest unlabeled. All three values are exact in
+ * every storage format, so they are written in it directly. Both choices are
+ * computed and selected, which the compiler turns into vector compares. */
+static void
+UPDATE_NAME (overlay_row_to_seeds) (const png_byte *row, void *seeds, int width)
+{
+  storage_t *seed_row = seeds;
+  int x;
+
+  for (x = 0; x < width; x++)
+  {
+    const png_byte *overlay_pixel = row + x * 4;
+    float label = (int) overlay_pixel [0] > (int) overlay_pixel [1] + 128 ? -1.0f : 1.0f;
+
+    seed_row [x] = STORE (overlay_pixel [3] > 0x80 ? label : 0.0f);
+  }
+}
+
+#undef UPDATE_NAME
+#undef UPDATE_NAME_1
+#undef UPDATE_NAME_2
@@ -44,27 +44,335 @@
  * and green as long as the corresponding red/green channels are dominant and
  * the pixels are not transparent.
  *
+ * The output alpha is hard by default. To get a soft edge, pass
+ * --soft-alpha=RADIUS; alpha is then estimated from local colour statistics
+ * and cell strengths within RADIUS pixels of the boundary:
+ *
+ * > cropsicle --soft-alpha=2 image.png overlay.png output.png
+ *
+ * Images too large to process in memory can be run with --out-of-core. The
+ * solver arrays are then kept in a scratch file in $TMPDIR (or the directory
+ * given with --scratch-dir) and paged in a band of rows at a time. Only the
+ * solver arrays, about 40 bytes a pixel, go out of core: the decoded image
+ * stays in memory for the output, which takes 4 bytes a pixel, and so does
+ * the overlay until the seeds have been read from it.
+ *
+ * For large in-memory jobs, --alloc=thp or --alloc=hugetlb backs the solver
+ * arrays with 2 MB huge pages, and --alloc=file maps them from a scratch file.
+ *
+ * The number of worker threads is set with --threads=N. On multi-socket
+ * machines, --numa pins the workers to NUMA nodes so each node works on rows
+ * in its local memory.
+ *
+ * Workers can be pinned to CPUs with --affinity=core, which gives each its
+ * own physical core, or --affinity=smt, which also uses the other hardware
+ * threads of each core. Solving is bound by memory bandwidth, so two workers
+ * sharing a core may slow each other down; cropsicle --tune times both on
+ * the machine at hand (see below). By default the scheduler places them.
+ *
+ * On very wide images, --block-size=N stores the solver arrays in blocks of
+ * N x N pixels, N a power of two such as 256, visited along a Hilbert curve,
+ * so the rows above and below a pixel stay in cache. The result is the same.
+ * Rows are the default, and are faster as long as a few of them fit in the
+ * CPU's cache. Jobs with several overlays, and jobs run with --out-of-core,
+ * always use rows.
+ *
+ * The weights and strengths can be stored as 16-bit floats with
+ * --precision=fp16 or --precision=bf16, halving the memory and bandwidth the
+ * solver needs at a small cost in accuracy. Add --accuracy-report to also
+ * solve in full precision and print how many pixels changed label and how
+ * far strengths and alpha are off.
+ *
+ * The inner loops are built for several instruction sets, and the best one
+ * the CPU supports is used. To compare them, force one with --isa=generic,
+ * sse4.2, avx2 or avx512.
+ *
+ * The fastest settings depend on the machine and the image size. Run
+ * cropsicle --tune once to time the candidates on synthetic images of a few
+ * sizes; the winners are saved in ~/.cropsicle-profile (or the file given with
+ * --profile=FILE), and later runs pick the number of threads, the
+ * instruction set and the --affinity for each image from it. Options given
+ * on the command line override the profile.
+ *
+ * Jobs that are resubmitted with the same input can be answered from a
+ * cache: with --cache-dir=DIR, each result's alpha is saved in DIR under a
+ * hash of the decoded image, overlay and options, and an identical job later
+ * reuses it without solving. The edge weights computed from each image are
+ * kept there too, so an image segmented again with new seeds goes straight
+ * to solving. The least recently used entries are removed once the cache
+ * grows past --cache-size=MB (256 by default).
+ *
+ * Several overlays for the same image can be given at once, each followed
+ * by its output file. They are solved together, with the weights computed
+ * once and read once per iteration for all of them, which is much faster
+ * than separate runs. They can't be combined with --out-of-core,
+ * --accuracy-report, --preview or --cache-dir:
+ *
+ * > cropsicle image.png overlay1.png output1.png overlay2.png output2.png
+ *
+ * Long jobs can be saved as they go, so they survive being stopped: with
+ * --checkpoint=FILE, the solver's progress is written to FILE every five
+ * minutes (or every --checkpoint-interval=SECONDS), and running the same job
+ * again with --resume continues from there. The file is removed when the job
+ * finishes. Each save holds the solver up for about one pass over the
+ * strengths while they're copied, and the copy takes as much memory again,
+ * which --mem-limit and --mem-budget count. Together with --cache-dir, a
+ * resumed job also reuses the weights and goes straight back to solving:
+ *
+ * > cropsicle --checkpoint=job.ckpt --resume image.png overlay.png output.png
+ *
+ * To watch a long job, pass --preview=FILE. While solving, a scaled-down
+ * mask of the labels found so far is written to FILE every second (or every
+ * --preview-interval=SECONDS, or every --preview-iterations=N iterations):
+ * white for foreground, black for background and grey where the labels have
+ * not spread yet. It is written in the background and replaced atomically,
+ * so a viewer can reload it at any time.
+ *
+ * A job can be stopped before it is done. --deadline=SECONDS stops any job
+ * that runs longer than that, and sending the process SIGUSR1 stops the job
+ * in progress, as a front end would when a newer request supersedes it. A
+ * stopped job writes no output and the next one in a batch starts right
+ * away; with --checkpoint, its progress is saved for --resume. The exit
+ * status is nonzero if any job was stopped.
+ *
+ * To process many images, list them in a file with one job per line, each
+ * line holding the image, overlay and output file names, and pass
+ * --batch=FILE (or --batch=- to read the list from stdin). The worker threads
+ * and job memory are set up once and reused, so jobs of similar size run
+ * without further allocation:
+ *
+ * > cropsicle --batch=jobs.txt
+ *
+ * Jobs are read while earlier ones run, so a front end can keep a batch
+ * running on stdin and feed it work. A line can start with
+ * --priority=interactive to get ahead of the others, which are bulk jobs by
+ * default. A running bulk job then makes way at the next iteration: its
+ * progress is saved in the scratch directory and it resumes from there once
+ * the interactive jobs are done, with its --deadline paused in between.
+ *
+ * When several cropsicle processes share a host, --mem-budget=MB keeps them
+ * from running it out of memory together. Each process works out the memory
+ * a job needs from the image size before decoding it, and waits until the
+ * jobs of the others leave enough room within the budget. They keep track
+ * of each other through a file in the scratch directory, so they must share
+ * it.
+ *
+ * To make each job fit in a given amount of memory, pass --mem-limit=MB.
+ * The storage is then picked from the image size: if the job doesn't fit as
+ * it is, the weights and strengths are kept in fp16, and if that doesn't fit
+ * either, it runs out of core in bands small enough to fit, in fp16 as a
+ * last resort. The changes are printed. A job too large to fit at all still
+ * runs, in the smallest storage, and is reported as over the limit. Settings
+ * given with --precision or --out-of-core are left alone.
+ *
+ * In a container, the defaults follow the limits of its cgroup (v2) instead
+ * of the host's. The number of threads is the CPU quota in cpu.max, rounded
+ * down, since a worker that is throttled holds up all the others. Three
+ * quarters of memory.max is used as --mem-limit, which leaves the rest for
+ * the program itself and the page cache. Unlike an explicit --mem-limit, it
+ * only ever moves a job out of core, never to fp16, so the output is the same
+ * as without a limit. --mem-budget is not set from the cgroup. Options given
+ * on the command line override these defaults.
+ *
  * Enjoy!
  */
 
+#define _GNU_SOURCE
+
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdarg.h>
 #include <math.h>
+#include <stdint.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
 
 #include <png.h>
 
 /* Define if you want a multithreaded implementation */
 #define WITH_THREADS
 
-/* Number of threads to use if multithreaded */
+/* Default number of worker threads if multithreaded */
 #define N_THREADS 4
 
+/* Where the cgroup v2 hierarchy is mounted, and the percentage of the
+ * cgroup's memory limit that jobs may use by default */
+#define CGROUP_ROOT "/sys/fs/cgroup"
+#define CGROUP_MEMORY_SHARE 75
+
 /* Define if you want to see the preprocessing effects applied to the image buffer */
 #undef SHOW_EFFECTS
 
+/* Soft alpha: colour separation (in 8-bit units) at which the colour model
+ * and the strength model are trusted equally */
+#define SOFT_ALPHA_COLOR_SEPARATION 32.0
+
+/* Row chunks per worker and iteration, for load balancing by work stealing */
+#define TASKS_PER_WORKER 8
+
+/* Maximum number of iterations before we give up on convergence */
+#define MAX_ITER 2000
+
+/* Default seconds between checkpoints */
+#define CHECKPOINT_INTERVAL 300
+
+/* Default seconds between previews, and their longest side in pixels */
+#define PREVIEW_INTERVAL 1
+#define PREVIEW_SIZE 512
+
+/* Most overlays that can be solved together against one image, and the
+ * multiple their number is rounded up to so the solver can work on whole
+ * vectors of them */
+#define MAX_SEED_SETS 64
+#define SEED_SET_LANES 8
+
+/* Out-of-core mode: default approximate memory to use for the tile being
+ * processed */
+#define OUT_OF_CORE_TILE_BYTES (64 * 1024 * 1024)
+
+/* Size and alignment of huge page backed solver arrays */
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+/* Result cache: default size limit, and the file name suffixes and format
+ * version of its entries */
+#define CACHE_SIZE_MB 256
+#define CACHE_ALPHA_SUFFIX ".alpha"
+#define CACHE_WEIGHTS_SUFFIX ".weights"
+#define CACHE_VERSION 1
+
+/* Memory admission: name of the ledger in the scratch directory, the most
+ * processes it tracks, and how often a waiting job checks it again */
+#define MEMORY_LEDGER_NAME "cropsicle-memory"
+#define MEMORY_LEDGER_ENTRIES 1024
+#define MEMORY_POLL_MS 100
+
+/* Settings --mem-limit may change to fit a job within it */
+#define FIT_PRECISION   (1 << 0)
+#define FIT_OUT_OF_CORE (1 << 1)
+
+/* Alignment of every block carved out of the job arena */
+#define CACHE_LINE_SIZE 64
+
+typedef enum
+{
+  ALLOC_MALLOC,   /* Plain heap allocation */
+  ALLOC_THP,      /* Anonymous mapping aligned and advised for transparent huge pages */
+  ALLOC_HUGETLB,  /* Explicit huge pages, falling back to ALLOC_THP */
+  ALLOC_FILE      /* Shared mapping of an unlinked file in the scratch directory */
+}
+AllocMode;
+
+typedef struct
+{
+  void *data;
+  size_t size;
+  AllocMode mode;
+}
+Buffer;
+
+typedef enum
+{
+  AFFINITY_NONE,  /* Let the scheduler place workers */
+  AFFINITY_CORE,  /* Pin each worker to its own physical core */
+  AFFINITY_SMT    /* Pin workers to every hardware thread, siblings first */
+}
+Affinity;
+
+typedef enum
+{
+  PRECISION_FP32,  /* float */
+  PRECISION_FP16,  /* IEEE half precision */
+  PRECISION_BF16   /* bfloat16, float with the low 16 mantissa bits dropped */
+}
+Precision;
+
+typedef struct Profile Profile;
+typedef struct CancelToken CancelToken;
+
+typedef struct
+{
+  /* Pixels within this many steps of the label boundary get a soft alpha
+   * estimate. 0 means hard alpha everywhere. */
+  int soft_alpha_radius;
+
+  /* Keep solver arrays in a scratch file in scratch_dir instead of memory,
+   * working on tiles of about tile_bytes */
+  int out_of_core;
+  const char *scratch_dir;
+  size_t tile_bytes;
+
+  /* How the in-memory solver arrays are backed */
+  AllocMode alloc_mode;
+
+  /* Number of worker threads, whether to pin them to NUMA nodes, and how
+   * to pin them to CPUs */
+  int n_threads;
+  int numa;
+  Affinity affinity;
+
+  /* Side of the blocks the solver arrays are stored in, or 0 for rows */
+  int block_size;
+
+  /* Storage format of the weights and strengths, and whether to compare
+   * the result with fp32 */
+  Precision precision;
+  int accuracy_report;
+
+  /* Name of the kernel set to use, NULL for the best supported one */
+  const char *isa;
+
+  /* Tuned settings by image size from --tune, or NULL */
+  const Profile *profile;
+
+  /* Directory of cached results, or NULL, and its size limit in bytes */
+  const char *cache_dir;
+  size_t cache_size;
+
+  /* File to save solver progress to every checkpoint_interval seconds, or
+   * NULL, and whether to resume from it. With checkpoint_on_preempt, it's
+   * only saved if the job is preempted, and isn't keyed by the job's input:
+   * the caller owns the file and only ever resumes the same job from it. */
+  const char *checkpoint_path;
+  int checkpoint_interval;
+  int resume;
+  int checkpoint_on_preempt;
+
+  /* File to write a preview mask to while solving, or NULL, and how often:
+   * every preview_iterations iterations if nonzero, otherwise every
+   * preview_interval seconds */
+  const char *preview_path;
+  int preview_interval;
+  int preview_iterations;
+
+  /* Seconds a job may take before it's stopped, 0 for no limit */
+  int deadline;
+
+  /* Token of the job in progress, or NULL */
+  CancelToken *cancel;
+
+  /* Bytes the job arenas of all processes sharing scratch_dir may hold
+   * together, or 0 for no limit */
+  size_t mem_budget;
+
+  /* Bytes a single job may use, or 0 for no limit, and the FIT_* flags of
+   * the settings that may be changed to stay within it */
+  size_t mem_limit;
+  int fit;
+}
+Options;
+
 typedef struct
 {
   png_bytep *rows;
@@ -74,6 +382,16 @@ typedef struct
 }
 Image;
 
+/* What process_file () reports back, for comparing storage formats */
+typedef struct
+{
+  int iterations;
+
+  /* If non-NULL, receives the final strengths as floats */
+  float *strength;
+}
+JobStats;
+
 static void
 abort_ (const char *s, ...)
 {
@@ -86,81 +404,120 @@ abort_ (const char *s, ...)
   abort ();
 }
 
-static void
-read_png_file (const char *file_name, Image *image)
+/* PNG files are read in two steps: the header first, so the job can be sized
+ * from the dimensions before any memory is committed, and then the pixel data
+ * into rows provided by the caller. */
+
+typedef struct
 {
-  char header [8];
+  FILE *fp;
   png_structp png_ptr;
   png_infop info_ptr;
+
+  /* Set for readers that copy an image in memory instead */
+  const Image *source;
+}
+PngReader;
+
+static void
+png_reader_open (PngReader *reader, const char *file_name, Image *image)
+{
+  char header [8];
   int number_of_passes;
-  int x, y;
-  FILE *fp;
 
   /* Open file and check file type */
 
-  fp = fopen (file_name, "rb");
-  if (!fp)
+  reader->source = NULL;
+  reader->fp = fopen (file_name, "rb");
+  if (!reader->fp)
     abort_ ("File %s could not be opened for reading", file_name);
 
-  fread (header, 1, 8, fp);
+  fread (header, 1, 8, reader->fp);
 
   if (png_sig_cmp (header, 0, 8))
     abort_ ("File %s is not a PNG file", file_name);
 
   /* Initialize */
 
-  png_ptr = png_create_read_struct (PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-  if (!png_ptr)
+  reader->png_ptr = png_create_read_struct (PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+  if (!reader->png_ptr)
     abort_ ("png_create_read_struct failed");
 
-  info_ptr = png_create_info_struct (png_ptr);
-  if (!info_ptr)
+  reader->info_ptr = png_create_info_struct (reader->png_ptr);
+  if (!reader->info_ptr)
     abort_ ("png_create_info_struct failed");
 
-  if (setjmp (png_jmpbuf (png_ptr)))
+  if (setjmp (png_jmpbuf (reader->png_ptr)))
     abort_ ("Error during init_io");
 
-  png_init_io (png_ptr, fp);
-  png_set_sig_bytes (png_ptr, 8);
+  png_init_io (reader->png_ptr, reader->fp);
+  png_set_sig_bytes (reader->png_ptr, 8);
+
+  png_read_info (reader->png_ptr, reader->info_ptr);
 
-  png_read_info (png_ptr, info_ptr);
+  image->rows = NULL;
+  image->width = png_get_image_width (reader->png_ptr, reader->info_ptr);
+  image->height = png_get_image_height (reader->png_ptr, reader->info_ptr);
+  image->color_type = png_get_color_type (reader->png_ptr, reader->info_ptr);
+  image->bit_depth = png_get_bit_depth (reader->png_ptr, reader->info_ptr);
 
-  image->width = png_get_image_width (png_ptr, info_ptr);
-  image->height = png_get_image_height (png_ptr, info_ptr);
-  image->color_type = png_get_color_type (png_ptr, info_ptr);
-  image->bit_depth = png_get_bit_depth (png_ptr, info_ptr);
+  if (image->color_type == PNG_COLOR_TYPE_RGB)
+    abort_ ("Input file is PNG_COLOR_TYPE_RGB but must be PNG_COLOR_TYPE_RGBA "
+            "(missing alpha channel)");
 
-  number_of_passes = png_set_interlace_handling (png_ptr);
-  png_read_update_info (png_ptr, info_ptr);
+  if (image->color_type != PNG_COLOR_TYPE_RGBA)
+    abort_ ("Color_type of input file must be PNG_COLOR_TYPE_RGBA (%d) (is %d)",
+            PNG_COLOR_TYPE_RGBA, image->color_type);
 
-  /* Read file */
+  if (image->bit_depth != 8)
+    abort_ ("Input file must have 8 bits per channel (has %d)", image->bit_depth);
 
-  if (setjmp (png_jmpbuf (png_ptr)))
-    abort_ ("Error during read_image");
+  number_of_passes = png_set_interlace_handling (reader->png_ptr);
+  png_read_update_info (reader->png_ptr, reader->info_ptr);
+}
 
-  image->rows = (png_bytep*) malloc (sizeof (png_bytep) * image->height);
-  for (y = 0; y < image->height; y++)
-    image->rows [y] = (png_byte*) malloc (png_get_rowbytes (png_ptr, info_ptr));
+/* Opens a reader that hands out a copy of source, as if decoded from a file */
+static void
+png_reader_open_image (PngReader *reader, const Image *source, Image *image)
+{
+  memset (reader, 0, sizeof (PngReader));
+  reader->source = source;
 
-  png_read_image (png_ptr, image->rows);
-  fclose (fp);
+  *image = *source;
+  image->rows = NULL;
+}
 
-  if (png_get_color_type (png_ptr, info_ptr) == PNG_COLOR_TYPE_RGB)
-    abort_ ("Input file is PNG_COLOR_TYPE_RGB but must be PNG_COLOR_TYPE_RGBA "
-            "(missing alpha channel)");
+/* Reads the pixel data into rows [], which must hold image->height pointers
+ * to image->width * 4 bytes each, and closes the file */
+static void
+png_reader_read (PngReader *reader, Image *image, png_bytep *rows)
+{
+  int y;
 
-  if (png_get_color_type (png_ptr, info_ptr) != PNG_COLOR_TYPE_RGBA)
-    abort_ ("Color_type of input file must be PNG_COLOR_TYPE_RGBA (%d) (is %d)",
-            PNG_COLOR_TYPE_RGBA, png_get_color_type (png_ptr, info_ptr));
+  image->rows = rows;
+
+  if (reader->source)
+  {
+    for (y = 0; y < image->height; y++)
+      memcpy (rows [y], reader->source->rows [y], (size_t) image->width * 4);
+    return;
+  }
+
+  if (setjmp (png_jmpbuf (reader->png_ptr)))
+    abort_ ("Error during read_image");
+
+  png_read_image (reader->png_ptr, image->rows);
+
+  png_destroy_read_struct (&reader->png_ptr, &reader->info_ptr, NULL);
+  fclose (reader->fp);
 }
 
 static void
-write_png_file (Image *image, char *file_name)
+write_png_file (const Image *image, const char *file_name)
 {
   FILE *fp = fopen (file_name, "wb");
   png_structp png_ptr;
   png_infop info_ptr;
-  int x, y;
 
   if (!fp)
     abort_ ("File %s could not be opened for writing", file_name);
@@ -210,11 +567,306 @@ write_png_file (Image *image, char *file_name)
 
   /* Cleanup */
 
+  png_destroy_write_struct (&png_ptr, &info_ptr);
+  fclose (fp);
+}
+
+/* Solver array allocation
+ * -----------------------
+ *
+ * The large per-pixel arrays are allocated through this layer so they can be
+ * backed by huge pages (fewer TLB misses when streaming over multi-GB weight
+ * arrays) or by an unlinked scratch file the kernel can page out. */
+
+static int
+create_scratch_fd (const char *dir)
+{
+  char path [PATH_MAX];
+  int fd;
+
+  if (snprintf (path, sizeof (path), "%s/cropsicle-XXXXXX", dir) >= (int) sizeof (path))
+    abort_ ("Scratch directory name too long: %s", dir);
+
+  fd = mkstemp (path);
+  if (fd < 0)
+    abort_ ("Could not create scratch file in %s: %s", dir, strerror (errno));
+
+  unlink (path);
+  return fd;
+}
+
+static void *
+buffer_alloc (Buffer *buffer, size_t size, const Options *options)
+{
+  size_t huge_size = (size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+  char *p;
+  int fd;
+
+  buffer->mode = options->alloc_mode;
+  buffer->size = size;
+
+  switch (buffer->mode)
+  {
+    case ALLOC_MALLOC:
+      if (posix_memalign (&buffer->data, CACHE_LINE_SIZE, size) != 0)
+        buffer->data = NULL;
+      break;
+
+    case ALLOC_HUGETLB:
+      p = mmap (NULL, huge_size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+      if (p != MAP_FAILED)
+      {
+        buffer->size = huge_size;
+        buffer->data = p;
+        break;
+      }
+
+      /* No explicit huge pages reserved; transparent ones are the next best thing */
+      buffer->mode = ALLOC_THP;
+      /* Fall through */
+
+    case ALLOC_THP:
+      /* Over-allocate so we can trim to a huge page boundary */
+      p = mmap (NULL, huge_size + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (p == MAP_FAILED)
+        abort_ ("Could not map %zu bytes: %s", size, strerror (errno));
+
+      buffer->data = (void *) (((uintptr_t) p + HUGE_PAGE_SIZE - 1) & ~(uintptr_t) (HUGE_PAGE_SIZE - 1));
+      if ((char *) buffer->data > p)
+        munmap (p, (char *) buffer->data - p);
+      munmap ((char *) buffer->data + huge_size, p + HUGE_PAGE_SIZE - (char *) buffer->data);
+
+      buffer->size = huge_size;
+      madvise (buffer->data, huge_size, MADV_HUGEPAGE);
+      break;
+
+    case ALLOC_FILE:
+      fd = create_scratch_fd (options->scratch_dir);
+      if (ftruncate (fd, size) < 0)
+        abort_ ("Could not size scratch file: %s", strerror (errno));
+
+      buffer->data = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+      if (buffer->data == MAP_FAILED)
+        abort_ ("Could not map scratch file: %s", strerror (errno));
+
+      /* The mapping keeps the file alive */
+      close (fd);
+      break;
+  }
+
+  if (!buffer->data)
+    abort_ ("Could not allocate %zu bytes", size);
+
+  return buffer->data;
+}
+
+static void
+buffer_free (Buffer *buffer)
+{
+  if (!buffer->data)
+    return;
+
+  if (buffer->mode == ALLOC_MALLOC)
+    free (buffer->data);
+  else
+    munmap (buffer->data, buffer->size);
+
+  buffer->data = NULL;
+}
+
+/* Memory admission
+ * ----------------
+ *
+ * Several cropsicle processes can share a host. With --mem-budget, each
+ * records the size of its job arena in a ledger in the scratch directory,
+ * one "<pid> <bytes>" line per process, and before the arena grows for a
+ * job it waits until the others leave room for it. The arena is sized from
+ * the PNG headers, so this happens before any pixel data is decoded.
+ * Entries of processes that have exited are dropped. A job that doesn't
+ * fit the budget even on its own is let in once nothing else holds any
+ * memory. A process holds nothing while it waits, and a batch gives its
+ * arena back whenever it runs out of jobs. */
+
+typedef struct
+{
+  int pid;
+  size_t bytes;
+}
+LedgerEntry;
+
+/* Sets this process' entry in the ledger to bytes, or removes it if bytes is
+ * 0. If wait is set, first waits until the other entries and bytes fit the
+ * budget together, with the entry removed in the meantime. */
+static void
+memory_ledger_set (const Options *options, size_t bytes, int wait)
+{
+  LedgerEntry entries [MEMORY_LEDGER_ENTRIES];
+  char path [PATH_MAX];
+  int waiting = 0;
+
+  if (snprintf (path, sizeof (path), "%s/%s", options->scratch_dir, MEMORY_LEDGER_NAME) >= (int) sizeof (path))
+    abort_ ("Scratch directory name too long: %s", options->scratch_dir);
+
+  for (;;)
+  {
+    size_t others = 0;
+    int n_entries = 0;
+    LedgerEntry entry;
+    FILE *fp;
+    int fd, i, fits;
+
+    fd = open (path, O_RDWR | O_CREAT, 0666);
+    if (fd < 0 || !(fp = fdopen (fd, "r+")))
+      abort_ ("Could not open memory ledger %s: %s", path, strerror (errno));
+    if (flock (fd, LOCK_EX) != 0)
+      abort_ ("Could not lock memory ledger %s: %s", path, strerror (errno));
+
+    while (fscanf (fp, "%d %zu", &entry.pid, &entry.bytes) == 2 && n_entries < MEMORY_LEDGER_ENTRIES)
+    {
+      if (entry.pid == getpid () || (kill (entry.pid, 0) != 0 && errno == ESRCH))
+        continue;
+
+      entries [n_entries++] = entry;
+      others += entry.bytes;
+    }
+
+    fits = !wait || others == 0 || others + bytes <= options->mem_budget;
+
+    rewind (fp);
+    if (ftruncate (fd, 0) != 0)
+      abort_ ("Could not write memory ledger %s: %s", path, strerror (errno));
+
+    for (i = 0; i < n_entries; i++)
+      fprintf (fp, "%d %zu\n", entries [i].pid, entries [i].bytes);
+    if (fits && bytes > 0)
+      fprintf (fp, "%d %zu\n", (int) getpid (), bytes);
+
+    /* Closing drops the lock */
+    if (fclose (fp) != 0)
+      abort_ ("Could not write memory ledger %s: %s", path, strerror (errno));
+
+    if (fits)
+      return;
+
+    if (!waiting)
+      fprintf (stderr, "Waiting for memory: the job needs %zu MB, and other jobs hold %zu MB of %zu MB\n",
+               bytes >> 20, others >> 20, options->mem_budget >> 20);
+    waiting = 1;
+
+    usleep (MEMORY_POLL_MS * 1000);
+  }
+}
+
+/* Job arena
+ * ---------
+ *
+ * Everything a job needs, from the decoded rows through the solver arrays to
+ * the workers' scratch rows, is carved out of one block that is sized from
+ * the image dimensions before decoding starts. The block is kept between jobs
+ * and only replaced when a larger job comes along, so a batch of similar
+ * images is processed without going back to the allocator.
+ *
+ * Blocks are cache line aligned, so no two workers' scratch share a line. */
+
+typedef struct
+{
+  Buffer buffer;
+  AllocMode mode;
+  size_t used;
+}
+Arena;
+
+static size_t
+arena_round (size_t size)
+{
+  return (size + CACHE_LINE_SIZE - 1) & ~(size_t) (CACHE_LINE_SIZE - 1);
+}
+
+/* Empties the arena and makes sure it can hold size bytes, waiting for
+ * memory if there's a budget */
+static void
+arena_reset (Arena *arena, size_t size, const Options *options)
+{
+  arena->used = 0;
+
+  if (arena->buffer.data && arena->buffer.size >= size && arena->mode == options->alloc_mode)
+    return;
+
+  buffer_free (&arena->buffer);
+  if (options->mem_budget)
+    memory_ledger_set (options, size, 1);
+  buffer_alloc (&arena->buffer, size, options);
+  arena->mode = options->alloc_mode;
+}
+
+/* Frees the arena's block, and gives its memory back to the budget */
+static void
+arena_free (Arena *arena, const Options *options)
+{
+  buffer_free (&arena->buffer);
+  if (options->mem_budget)
+    memory_ledger_set (options, 0, 0);
+}
+
+static void *
+arena_alloc (Arena *arena, size_t size)
+{
+  void *p;
+
+  size = arena_round (size);
+  if (size > arena->buffer.size - arena->used)
+    abort_ ("Job arena exhausted (%zu bytes requested, %zu of %zu in use)",
+            size, arena->used, arena->buffer.size);
+
+  p = (char *) arena->buffer.data + arena->used;
+  arena->used += size;
+  return p;
+}
+
+/* Hands the pages inside a dead block back to the system. They read as zero
+ * or stale data if touched again, so the block can be reused as scratch. */
+static void
+arena_release (Arena *arena, void *p, size_t size)
+{
+  uintptr_t page_size = sysconf (_SC_PAGESIZE);
+  uintptr_t start = ((uintptr_t) p + page_size - 1) & ~(page_size - 1);
+  uintptr_t end = ((uintptr_t) p + size) & ~(page_size - 1);
+
+  if (end <= start)
+    return;
+
+  /* Dropping a shared mapping would leave the pages in the page cache */
+  madvise ((void *) start, end - start,
+           arena->buffer.mode == ALLOC_FILE ? MADV_REMOVE : MADV_DONTNEED);
+}
+
+static size_t
+image_arena_size (int width, int height)
+{
+  return arena_round ((size_t) height * sizeof (png_bytep))
+    + arena_round ((size_t) width * height * 4);
+}
+
+/* Lays out rows for image in the image_arena_size () bytes at p */
+static png_bytep *
+image_rows_at (const Image *image, void *p)
+{
+  png_bytep *rows = p;
+  png_bytep pixels = (png_bytep) p + arena_round ((size_t) image->height * sizeof (png_bytep));
+  int y;
+
   for (y = 0; y < image->height; y++)
-    free (image->rows [y]);
-  free (image->rows);
+    rows [y] = pixels + (size_t) y * image->width * 4;
 
-  fclose (fp);
+  return rows;
+}
+
+static png_bytep *
+image_rows_alloc (const Image *image, Arena *arena)
+{
+  return image_rows_at (image, arena_alloc (arena, image_arena_size (image->width, image->height)));
 }
 
 static void
@@ -281,447 +933,5529 @@ test_process_file (Image *image, Image *overlay)
 static const int nx8 [8] = { -1,  0,  1, -1, 1, -1, 0, 1 };
 static const int ny8 [8] = { -1, -1, -1,  0, 0,  1, 1, 1 };
 
-static void
-process_pixel_neighbor_border (const Image *image, int index, const float *overlay_array_in, float *overlay_array_out,
-                               const float *g_array, const int *neighbor_index_ofs, int i, int *converged)
+/* Pixels per block in calc_g_row (); the block lives on the stack */
+#define CALC_G_BLOCK 64
+
+/* Colour rows are planar: a row holds all its red values, then all green,
+ * then all blue, so the preprocessing kernels work on unit-stride vectors.
+ * Each plane is padded to whole cache lines, keeping them aligned. */
+
+static inline int
+colour_plane_width (int width)
 {
-  int neighbor_index = index + neighbor_index_ofs [i];
-  float g = g_array [index * 8 + i];
+  const int floats_per_line = CACHE_LINE_SIZE / sizeof (float);
 
-  if (fabsf (g * overlay_array_in [neighbor_index]) > fabsf (overlay_array_out [index]))
-  {
-    overlay_array_out [index] = g * overlay_array_in [neighbor_index];
-    *converged = 0;
-  }
+  return (width + floats_per_line - 1) & ~(floats_per_line - 1);
 }
 
-static void
-process_pixel_border (const Image *image, int x, int y, const float *overlay_array_in, float *overlay_array_out,
-                      const float *g_array, const int *neighbor_index_ofs, int *converged)
+/* Floats per colour row */
+static inline size_t
+colour_row_size (int width)
 {
-  int index = image->width * y + x;
-  int i;
-
-  overlay_array_out [index] = overlay_array_in [index];
+  return (size_t) colour_plane_width (width) * 3;
+}
 
-  for (i = 0; i < 8; i++)
-  {
-    if (x + nx8 [i] < 0 || x + nx8 [i] >= image->width ||
-        y + ny8 [i] < 0 || y + ny8 [i] >= image->height)
-      continue;
+/* Storage formats
+ * ---------------
+ *
+ * The iterations stream over 32 bytes of weights and 8 bytes of strengths
+ * per pixel and are bound by memory bandwidth. Weights are in [0, 1] and
+ * strengths in [-1, 1], so they can be stored as 16-bit floats at half the
+ * traffic, and converted to float in registers. */
 
-    process_pixel_neighbor_border (image, index, overlay_array_in, overlay_array_out, g_array,
-                                   neighbor_index_ofs, i, converged);
-  }
+static size_t
+precision_size (Precision precision)
+{
+  return precision == PRECISION_FP32 ? sizeof (float) : sizeof (uint16_t);
 }
 
-static void
-process_pixel_neighbor_internal (int index, const float *overlay_array_in, float *overlay_array_out,
-                                 const float *g_array, const int *neighbor_index_ofs, int i,
-                                 int *converged)
+static inline float
+bf16_to_float (uint16_t v)
 {
-  int neighbor_index = index + neighbor_index_ofs [i];
-  float g = g_array [index * 8 + i];
+  uint32_t bits = (uint32_t) v << 16;
+  float f;
 
-  if (fabsf (g * overlay_array_in [neighbor_index]) > fabsf (overlay_array_out [index]))
-  {
-    overlay_array_out [index] = g * overlay_array_in [neighbor_index];
-    *converged = 0;
-  }
+  memcpy (&f, &bits, sizeof (f));
+  return f;
 }
 
-static void
-process_pixel_internal (int index, const float *overlay_array_in, float *overlay_array_out,
-                        const float *g_array, const int *neighbor_index_ofs,
-                        int *converged)
+/* Rounds to nearest even. Our values are always finite. */
+static inline uint16_t
+float_to_bf16 (float f)
 {
-  int i;
+  uint32_t bits;
 
-  overlay_array_out [index] = overlay_array_in [index];
-
-  for (i = 0; i < 8; i++)
-    process_pixel_neighbor_internal (index, overlay_array_in, overlay_array_out, g_array,
-                                     neighbor_index_ofs, i, converged);
+  memcpy (&bits, &f, sizeof (bits));
+  bits += 0x7fff + ((bits >> 16) & 1);
+  return bits >> 16;
 }
 
-#ifdef WITH_THREADS
+/* IEEE half precision conversions done with integer and float arithmetic, so
+ * they vectorize along with the kernels. Only finite values in [-1, 1] are
+ * stored, so infinities and NaNs need no handling. */
 
-typedef struct
+static inline float
+fp16_to_float (uint16_t v)
 {
-  const Image *image;
-  const int *neighbor_index_ofs;
-  const float *image_array;
-  const float *overlay_array_in;
-  float *overlay_array_out;
-  const float *g_array;
-  int index_max;
-  int thread_n;
+  uint32_t bits = (uint32_t) (v & 0x7fff) << 13;
+  float f;
+
+  /* Rebias the exponent by scaling, which gets subnormals right too */
+  memcpy (&f, &bits, sizeof (f));
+  f *= 0x1p112f;
+  memcpy (&bits, &f, sizeof (bits));
+  bits |= (uint32_t) (v & 0x8000) << 16;
+  memcpy (&f, &bits, sizeof (f));
+  return f;
 }
-ThreadArgs;
 
-static void *
-process_iteration_thread (ThreadArgs *args)
+/* Rounds to nearest even */
+static inline uint16_t
+float_to_fp16 (float f)
 {
-  int index;
-  int converged = 1;
+  const float subnormal_magic = 0x1p-1f;
+  uint32_t bits, sign, normal, subnormal, is_subnormal;
+  float g;
 
-  for (index = args->image->width + args->thread_n * args->image->width + 1;
-       index < args->index_max;
-       index++)
-  {
-    int index_line_max = index + args->image->width - 2;
+  memcpy (&bits, &f, sizeof (bits));
+  sign = (bits >> 16) & 0x8000;
+  bits &= 0x7fffffff;
 
-    for ( ; index < index_line_max; index++)
-      process_pixel_internal (index, args->overlay_array_in, args->overlay_array_out, args->g_array,
-                              args->neighbor_index_ofs, &converged);
+  /* Subnormal results: adding 0.5 makes the float unit do the rounding */
+  memcpy (&g, &bits, sizeof (g));
+  g += subnormal_magic;
+  memcpy (&subnormal, &g, sizeof (subnormal));
+  subnormal -= 0x3f000000;
 
-    index += (N_THREADS - 1) * args->image->width;
-    index++;
-  }
+  normal = (bits + ((uint32_t) (15 - 127) << 23) + 0xfff + ((bits >> 13) & 1)) >> 13;
 
-  return (void *) converged;
+  /* Select with a mask; a conditional here keeps the kernels from vectorizing */
+  is_subnormal = -(uint32_t) (bits < (uint32_t) (127 - 14) << 23);
+  return sign | (subnormal & is_subnormal) | (normal & ~is_subnormal);
 }
 
-static void *
-process_iteration_borders_thread (ThreadArgs *args)
+static float
+load_float (Precision precision, const void *src, size_t index)
 {
-  int converged = 1;
-  int x, y;
-
-  for (x = 0; x < args->image->width; x++)
-    process_pixel_border (args->image, x, 0, args->overlay_array_in, args->overlay_array_out, args->g_array,
-                          args->neighbor_index_ofs, &converged);
-
-  for (x = 0; x < args->image->width; x++)
-    process_pixel_border (args->image, x, args->image->height - 1, args->overlay_array_in, args->overlay_array_out, args->g_array,
-                          args->neighbor_index_ofs, &converged);
-
-  for (y = 1; y < args->image->height - 1; y++)
-    process_pixel_border (args->image, 0, y, args->overlay_array_in, args->overlay_array_out, args->g_array,
-                          args->neighbor_index_ofs, &converged);
-
-  for (y = 1; y < args->image->height - 1; y++)
-    process_pixel_border (args->image, args->image->width - 1, y, args->overlay_array_in, args->overlay_array_out, args->g_array,
-                          args->neighbor_index_ofs, &converged);
-
-  return (void *) converged;
+  switch (precision)
+  {
+    case PRECISION_FP16:
+      return fp16_to_float (((const uint16_t *) src) [index]);
+    case PRECISION_BF16:
+      return bf16_to_float (((const uint16_t *) src) [index]);
+    default:
+      return ((const float *) src) [index];
+  }
 }
 
-static int
-process_iteration (const Image *image, const float *image_array, const float *overlay_array_in, float *overlay_array_out, const float *g_array)
+/* Converts n floats to the storage format */
+static void
+pack_floats (Precision precision, void *dst, const float *src, size_t n)
 {
-  int converged = 1;
-  int index;
-  int index_max = (image->height - 1) * image->width - 1;
-  int neighbor_index_ofs [8];
-  ThreadArgs thread_args [N_THREADS + 1];
-  pthread_t thread_info [N_THREADS + 1];
-  int i;
-
-  for (i = 0; i < 8; i++)
-    neighbor_index_ofs [i] = nx8 [i] + ny8 [i] * image->width;
+  size_t i;
 
-  thread_args [0].image = image;
-  thread_args [0].neighbor_index_ofs = neighbor_index_ofs;
-  thread_args [0].image_array = image_array;
-  thread_args [0].overlay_array_in = overlay_array_in;
-  thread_args [0].overlay_array_out = overlay_array_out;
-  thread_args [0].g_array = g_array;
-  thread_args [0].index_max = index_max;
-  thread_args [0].thread_n = 0;
-
-  for (i = 1; i < N_THREADS + 1; i++)
+  switch (precision)
   {
-    thread_args [i] = thread_args [0];
-    thread_args [i].thread_n = i;
+    case PRECISION_FP16:
+      for (i = 0; i < n; i++)
+        ((uint16_t *) dst) [i] = float_to_fp16 (src [i]);
+      break;
+    case PRECISION_BF16:
+      for (i = 0; i < n; i++)
+        ((uint16_t *) dst) [i] = float_to_bf16 (src [i]);
+      break;
+    default:
+      memcpy (dst, src, n * sizeof (float));
+      break;
   }
+}
 
-  /* Internal area */
+static void
+unpack_floats (Precision precision, float *dst, const void *src, size_t n)
+{
+  size_t i;
 
-  for (i = 0; i < N_THREADS; i++)
-    pthread_create (&thread_info [i], NULL, (void *(*)(void *)) process_iteration_thread, &thread_args [i]);
+  for (i = 0; i < n; i++)
+    dst [i] = load_float (precision, src, i);
+}
+
+/* Blocked layout
+ * --------------
+ *
+ * In rows, the neighbors above and below a pixel are a whole row away, so
+ * on very wide images they have left the cache by the time the solver comes
+ * back for them. With --block-size=N, the solver's strengths and weights are
+ * stored in blocks of N x N pixels instead, each block contiguous and in
+ * rows of its own width, so a block and the edges of its neighbors stay in
+ * cache while it's worked on. The blocks are stored and walked along a
+ * Hilbert curve over the block grid: each worker's share of them is then a
+ * compact patch of the image rather than a band, and it's the same patch
+ * every iteration.
+ *
+ * Blocks on the right and bottom edges are narrower or shorter; nothing is
+ * padded, so the arrays are the same size as in rows. Each block has its
+ * own neighbor offsets for the cells inside it, and cells on its edges reach
+ * into the blocks beside it. Preprocessing and everything after solving
+ * still see rows: the weights are written into the blocks as they're
+ * computed, and the strengths are copied into blocks before solving and
+ * back afterwards. Only single-overlay jobs in memory use blocks. With
+ * --numa, the weights are still first touched a band of rows per worker,
+ * so the blocks a worker solves aren't all on its node.
+ *
+ * Blocks pay for their short inner loops and their edges, so they only win
+ * where a few rows of strengths no longer fit in the cache. Where the rows
+ * still fit, as in 2 MB of L2 even at 30000 pixels wide, rows are faster,
+ * so they're the default. */
+
+typedef struct
+{
+  int x0, y0, width, height;
 
-  /* Borders */
+  /* Index of its first cell, and the offsets of the neighbors of the cells
+   * inside it */
+  ptrdiff_t base;
+  int neighbor_index_ofs [8];
+}
+Block;
+
+typedef struct
+{
+  int width, height;
+
+  /* The blocks in Hilbert order, or NULL for rows, their size as a power of
+   * two, and where in that order each block is, by block row */
+  Block *blocks;
+  int shift;
+  int n_blocks_x, n_blocks_y, n_blocks;
+  int *block_order;
+}
+Layout;
 
-  pthread_create (&thread_info [N_THREADS], NULL, (void *(*)(void *)) process_iteration_borders_thread, &thread_args [N_THREADS]);
+typedef struct
+{
+  size_t hilbert_index;
+  int block;
+}
+BlockKey;
 
-  /* Wait for threads and collect results */
+/* Distance along a Hilbert curve filling an n x n grid, n a power of two */
+static size_t
+hilbert_index (int n, int x, int y)
+{
+  size_t d = 0;
+  int s;
 
-  for (i = 0; i < N_THREADS + 1; i++)
+  for (s = n / 2; s > 0; s /= 2)
   {
-    void *ret;
+    int rx = (x & s) != 0;
+    int ry = (y & s) != 0;
+
+    d += (size_t) s * s * ((3 * rx) ^ ry);
+
+    /* Turn the quadrant so the curve enters it at its origin */
+    if (!ry)
+    {
+      int t;
+
+      if (rx)
+      {
+        x = n - 1 - x;
+        y = n - 1 - y;
+      }
 
-    pthread_join (thread_info [i], &ret);
-    converged &= (int) ret;
+      t = x;
+      x = y;
+      y = t;
+    }
   }
 
-  return converged;
+  return d;
 }
 
-#else
+static int
+compare_block_keys (const void *a, const void *b)
+{
+  const BlockKey *key_a = a, *key_b = b;
+
+  return (key_a->hilbert_index > key_b->hilbert_index) - (key_a->hilbert_index < key_b->hilbert_index);
+}
 
 static int
-process_iteration (const Image *image, const float *image_array, const float *overlay_array_in, float *overlay_array_out, const float *g_array)
+layout_n_blocks (int width, int height, int block_size)
 {
-  int converged = 1;
-  int index;
-  int index_max = (image->height - 1) * image->width - 1;
-  int neighbor_index_ofs [8];
-  int x, y;
+  return ((width + block_size - 1) / block_size) * ((height + block_size - 1) / block_size);
+}
+
+static size_t
+layout_arena_size (int width, int height, int block_size)
+{
+  int n_blocks;
+
+  if (!block_size)
+    return 0;
+
+  n_blocks = layout_n_blocks (width, height, block_size);
+  return arena_round (n_blocks * sizeof (Block)) + arena_round (n_blocks * sizeof (int));
+}
+
+/* Lays out a width x height image in blocks of block_size pixels, a power
+ * of two, or in rows if it's 0 */
+static void
+layout_init (Layout *layout, int width, int height, int block_size, Arena *arena)
+{
+  BlockKey *keys;
+  ptrdiff_t base = 0;
+  int grid_size;
   int i;
 
-  for (i = 0; i < 8; i++)
-    neighbor_index_ofs [i] = nx8 [i] + ny8 [i] * image->width;
+  memset (layout, 0, sizeof (Layout));
+  layout->width = width;
+  layout->height = height;
 
-  /* Internal area */
+  if (!block_size)
+    return;
 
-  for (index = image->width + 1; index < index_max; index++)
+  /* The kernels keep the offsets from a cell to its neighbors in ints, and
+   * across blocks they can be as large as the image */
+  if ((size_t) width * height > INT_MAX)
   {
-    int index_line_max = index + image->width - 2;
+    fprintf (stderr, "Image too large for --block-size, solving in rows\n");
+    return;
+  }
+
+  while ((1 << layout->shift) < block_size)
+    layout->shift++;
+
+  layout->n_blocks_x = (width + block_size - 1) >> layout->shift;
+  layout->n_blocks_y = (height + block_size - 1) >> layout->shift;
+  layout->n_blocks = layout_n_blocks (width, height, block_size);
+  layout->blocks = arena_alloc (arena, layout->n_blocks * sizeof (Block));
+  layout->block_order = arena_alloc (arena, layout->n_blocks * sizeof (int));
 
-    for ( ; index < index_line_max; index++)
-      process_pixel_internal (index, overlay_array_in, overlay_array_out, g_array,
-                              neighbor_index_ofs, &converged);
+  keys = malloc (layout->n_blocks * sizeof (BlockKey));
+  if (!keys)
+    abort_ ("Could not allocate memory for the block layout");
 
-    index++;
+  for (grid_size = 1; grid_size < layout->n_blocks_x || grid_size < layout->n_blocks_y; grid_size *= 2)
+    ;
+
+  for (i = 0; i < layout->n_blocks; i++)
+  {
+    keys [i].hilbert_index = hilbert_index (grid_size, i % layout->n_blocks_x, i / layout->n_blocks_x);
+    keys [i].block = i;
   }
 
-  /* Borders */
+  qsort (keys, layout->n_blocks, sizeof (BlockKey), compare_block_keys);
 
-  for (x = 0; x < image->width; x++)
-    process_pixel_border (image, x, 0, overlay_array_in, overlay_array_out, g_array,
-                          neighbor_index_ofs, &converged);
+  for (i = 0; i < layout->n_blocks; i++)
+  {
+    Block *block = &layout->blocks [i];
+    int j;
 
-  for (x = 0; x < image->width; x++)
-    process_pixel_border (image, x, image->height - 1, overlay_array_in, overlay_array_out, g_array,
-                          neighbor_index_ofs, &converged);
+    block->x0 = (keys [i].block % layout->n_blocks_x) << layout->shift;
+    block->y0 = (keys [i].block / layout->n_blocks_x) << layout->shift;
+    block->width = width - block->x0 < block_size ? width - block->x0 : block_size;
+    block->height = height - block->y0 < block_size ? height - block->y0 : block_size;
+    block->base = base;
+    base += (ptrdiff_t) block->width * block->height;
 
-  for (y = 1; y < image->height - 1; y++)
-    process_pixel_border (image, 0, y, overlay_array_in, overlay_array_out, g_array,
-                          neighbor_index_ofs, &converged);
+    for (j = 0; j < 8; j++)
+      block->neighbor_index_ofs [j] = nx8 [j] + ny8 [j] * block->width;
 
-  for (y = 1; y < image->height - 1; y++)
-    process_pixel_border (image, image->width - 1, y, overlay_array_in, overlay_array_out, g_array,
-                          neighbor_index_ofs, &converged);
+    layout->block_order [keys [i].block] = i;
+  }
 
-  return converged;
+  free (keys);
 }
 
-#endif
+/* Index of pixel (x, y) in arrays with layout */
+static inline ptrdiff_t
+layout_index (const Layout *layout, int x, int y)
+{
+  const Block *block;
 
-static void
-blur_image_array (Image *image, float *array)
+  if (!layout->blocks)
+    return (ptrdiff_t) y * layout->width + x;
+
+  block = &layout->blocks [layout->block_order [(y >> layout->shift) * layout->n_blocks_x
+                                                + (x >> layout->shift)]];
+  return block->base + (ptrdiff_t) (y - block->y0) * block->width + (x - block->x0);
+}
+
+/* The block next to block in direction (dx, dy), or NULL past the edge of
+ * the image */
+static inline const Block *
+layout_neighbor_block (const Layout *layout, const Block *block, int dx, int dy)
 {
-  const int nx9 [9] = { 0, -1,  0,  1, -1, 1, -1, 0, 1 };
-  const int ny9 [9] = { 0, -1, -1, -1,  0, 0,  1, 1, 1 };
-  float *temp_array;
-  int x, y;
-  int i;
+  int block_x = (block->x0 >> layout->shift) + dx;
+  int block_y = (block->y0 >> layout->shift) + dy;
 
-  temp_array = malloc (image->width * image->height * 3 * sizeof (float));
-  memset (temp_array, 0, image->width * image->height * 3 * sizeof (float));
+  if (block_x < 0 || block_x >= layout->n_blocks_x || block_y < 0 || block_y >= layout->n_blocks_y)
+    return NULL;
 
-  for (y = 0; y < image->height; y++)
+  return &layout->blocks [layout->block_order [block_y * layout->n_blocks_x + block_x]];
+}
+
+/* Number of pixels of a row, from x on, that follow each other in arrays
+ * with layout */
+static inline int
+layout_run (const Layout *layout, int x)
+{
+  int end = layout->width;
+
+  if (layout->blocks && ((x >> layout->shift) + 1) << layout->shift < end)
+    end = ((x >> layout->shift) + 1) << layout->shift;
+
+  return end - x;
+}
+
+/* Copies rows [y0, y1) of elements of element_size bytes from src in rows
+ * to dst with layout, or from src with layout to dst in rows if
+ * to_layout is zero */
+static void
+layout_copy_rows (const Layout *layout, char *dst, const char *src, size_t element_size,
+                  int to_layout, int y0, int y1)
+{
+  int x, y, n;
+
+  for (y = y0; y < y1; y++)
   {
-    for (x = 0; x < image->width; x++)
+    for (x = 0; x < layout->width; x += n)
     {
-      int index = (x + (y * image->width)) * 3;
-      int n_pixels = 0;
+      char *row = (to_layout ? (char *) src : dst) + ((size_t) y * layout->width + x) * element_size;
+      char *cells = (to_layout ? dst : (char *) src) + layout_index (layout, x, y) * element_size;
+
+      n = layout_run (layout, x);
+      if (to_layout)
+        memcpy (cells, row, n * element_size);
+      else
+        memcpy (row, cells, n * element_size);
+    }
+  }
+}
 
-      for (i = 0; i < 9; i++)
-      {
-        int neighbor_index;
+/* Instruction sets
+ * ----------------
+ *
+ * The hot loops are compiled once for the baseline target and again for each
+ * x86 instruction set level below. The best level the CPU supports is picked
+ * once at startup, and --isa can force a lower one for benchmarking. All
+ * levels give bit-identical results. */
 
-        if (x + nx9 [i] < 0 || x + nx9 [i] >= image->width ||
-            y + ny9 [i] < 0 || y + ny9 [i] >= image->height)
-          continue;
+typedef void (*ProcessRowsFunc) (const Image *image, int y0, int y1, int row_base, const void *in,
+                                 void *out, const void *g, const int *neighbor_index_ofs,
+                                 int *converged);
 
-        neighbor_index = (x + nx9 [i] + ((y + ny9 [i]) * image->width)) * 3;
+typedef void (*ProcessRowsSetsFunc) (const Image *image, int y0, int y1, int row_base, int n_sets,
+                                     const void *in, void *out, const void *g,
+                                     const int *neighbor_index_ofs, int *converged);
 
-        temp_array [index] += array [neighbor_index];
-        temp_array [index + 1] += array [neighbor_index + 1];
-        temp_array [index + 2] += array [neighbor_index + 2];
-        n_pixels++;
-      }
+typedef void (*ProcessBlockFunc) (const Image *image, const Layout *layout, const Block *block,
+                                  const void *in, void *out, const void *g, int *converged);
 
-      temp_array [index] /= (float) n_pixels;
-      temp_array [index + 1] /= (float) n_pixels;
-      temp_array [index + 2] /= (float) n_pixels;
-    }
+typedef void (*RowFilterFunc) (int width, const float *above, const float *row, const float *below,
+                               float *out);
+
+typedef struct
+{
+  const char *name;
+  void (*image_row_to_array) (const Image *image, int y, float *out);
+  RowFilterFunc blur_row;
+  RowFilterFunc calc_g_row;
+
+  /* Indexed by Precision */
+  ProcessRowsFunc process_rows [3];
+  ProcessRowsSetsFunc process_rows_sets [3];
+  ProcessBlockFunc process_block [3];
+  void (*strength_to_alpha_row [3]) (const void *strength, png_byte *row, int width);
+  void (*overlay_row_to_seeds [3]) (const png_byte *row, void *seeds, int width);
+}
+KernelSet;
+
+/* See cropsicle-kernels.h. GCC won't inline across functions compiled with
+ * different options unless this comes before the target pragmas. */
+#pragma GCC push_options
+#pragma GCC optimize ("finite-math-only")
+
+#define KERNEL_ISA generic
+#define KERNEL_ISA_NAME "generic"
+#include "cropsicle-kernels.h"
+#undef KERNEL_ISA
+#undef KERNEL_ISA_NAME
+
+#if defined (__x86_64__) || defined (__i386__)
+# define WITH_X86_KERNELS
+
+/* AVX-512 implies FMA, so contraction must be kept off for the results to
+ * match the other levels */
+
+# pragma GCC push_options
+# pragma GCC target ("sse4.2")
+# define KERNEL_ISA sse42
+# define KERNEL_ISA_NAME "sse4.2"
+# include "cropsicle-kernels.h"
+# undef KERNEL_ISA
+# undef KERNEL_ISA_NAME
+# pragma GCC pop_options
+
+# pragma GCC push_options
+# pragma GCC target ("avx2")
+# define KERNEL_ISA avx2
+# define KERNEL_ISA_NAME "avx2"
+# include "cropsicle-kernels.h"
+# undef KERNEL_ISA
+# undef KERNEL_ISA_NAME
+# pragma GCC pop_options
+
+# pragma GCC push_options
+# pragma GCC target ("avx512f,avx512bw,avx512vl")
+# pragma GCC optimize ("fp-contract=off")
+# define KERNEL_ISA avx512
+# define KERNEL_ISA_NAME "avx512"
+# include "cropsicle-kernels.h"
+# undef KERNEL_ISA
+# undef KERNEL_ISA_NAME
+# pragma GCC pop_options
+#endif
+
+#pragma GCC pop_options
+
+/* Chosen in main () before any work is done */
+static const KernelSet *kernels = &kernel_set_generic;
+
+static int
+cpu_supports_kernel_set (const KernelSet *set)
+{
+#ifdef WITH_X86_KERNELS
+  __builtin_cpu_init ();
+
+  if (set == &kernel_set_sse42)
+    return __builtin_cpu_supports ("sse4.2");
+  if (set == &kernel_set_avx2)
+    return __builtin_cpu_supports ("avx2");
+  if (set == &kernel_set_avx512)
+    return __builtin_cpu_supports ("avx512f") && __builtin_cpu_supports ("avx512bw")
+      && __builtin_cpu_supports ("avx512vl");
+#endif
+
+  return set == &kernel_set_generic;
+}
+
+/* Best first */
+static const KernelSet * const kernel_sets [] =
+{
+#ifdef WITH_X86_KERNELS
+  &kernel_set_avx512,
+  &kernel_set_avx2,
+  &kernel_set_sse42,
+#endif
+  &kernel_set_generic
+};
+
+#define N_KERNEL_SETS ((int) (sizeof (kernel_sets) / sizeof (kernel_sets [0])))
+
+/* Picks the named kernel set, or the best supported one if name is NULL */
+static const KernelSet *
+select_kernel_set (const char *name)
+{
+  int i;
+
+  for (i = 0; i < N_KERNEL_SETS; i++)
+  {
+    if (name && strcmp (name, kernel_sets [i]->name))
+      continue;
+
+    if (cpu_supports_kernel_set (kernel_sets [i]))
+      return kernel_sets [i];
+
+    if (name)
+      abort_ ("This CPU does not support %s", name);
   }
 
-  memcpy (array, temp_array, image->width * image->height * 3 * sizeof (float));
-  free (temp_array);
+  if (name)
+    abort_ ("Unknown instruction set '%s'", name);
+
+  return &kernel_set_generic;
 }
 
-#if 0
+/* Worker pool
+ * -----------
+ *
+ * A fixed set of worker threads is started once and kept for the life of
+ * the process, running every stage of every job; it is only replaced when a
+ * job asks for another number of workers (see pool_ensure ()). Work is
+ * handed out as a function that every worker runs once with its own index,
+ * and pool_run () returns when all of them are done.
+ *
+ * Workers always start on the same contiguous share of rows, so the rows of
+ * every array are first touched by the thread that later processes them. The
+ * solver lets idle workers steal rows from busy ones; see below. With
+ * --numa, workers are also spread evenly over the NUMA nodes and pinned to
+ * their node's CPUs. Each node then owns a contiguous block of rows in its
+ * local memory, and solver bandwidth scales with the number of sockets. */
 
-/* TODO: A further refinement would be to process in HSV color space, so we
- * can apply different weights to hue, saturation and value. Typically, hue
- * would have a higher weight. */
+typedef void (*PoolFunc) (int worker, int n_workers, void *data);
+
+typedef struct WorkerPool WorkerPool;
 
 static void
-image_array_to_hsv (Image *image, float *array)
+worker_rows (int worker, int n_workers, int y0, int y1, int *worker_y0, int *worker_y1)
 {
-  int x, y;
-  int i;
+  *worker_y0 = y0 + (int) ((long) (y1 - y0) * worker / n_workers);
+  *worker_y1 = y0 + (int) ((long) (y1 - y0) * (worker + 1) / n_workers);
+}
 
-  for (y = 0; y < image->height; y++)
+#ifdef WITH_THREADS
+
+typedef struct
+{
+  WorkerPool *pool;
+  int index;
+}
+Worker;
+
+struct WorkerPool
+{
+  int n_workers;
+  Worker *workers;
+  pthread_t *threads;
+
+  pthread_mutex_t mutex;
+  pthread_cond_t work_cond;
+  pthread_cond_t done_cond;
+  PoolFunc func;
+  void *data;
+  unsigned int generation;
+  int n_busy;
+  int quit;
+
+  /* For pool_barrier () */
+  pthread_cond_t barrier_cond;
+  unsigned int barrier_generation;
+  int n_arrived;
+
+  /* NUMA node and CPU for each worker, or NULL if not pinning, and how the
+   * CPUs were picked */
+  int *worker_nodes;
+  int *worker_cpus;
+  Affinity affinity;
+};
+
+/* Parses a sysfs list like "0-3,8-11" */
+static int
+read_cpu_list (const char *path, cpu_set_t *set)
+{
+  FILE *fp;
+  int a, b, c, i;
+
+  CPU_ZERO (set);
+
+  fp = fopen (path, "r");
+  if (!fp)
+    return 0;
+
+  while (fscanf (fp, "%d", &a) == 1)
   {
-    for (x = 0; x < image->width; x++)
-    {
-      int index = (x + (y * image->width)) * 3;
-      int n_pixels = 0;
+    b = a;
+    c = fgetc (fp);
 
-      temp_array [index] /= (float) n_pixels;
-      temp_array [index + 1] /= (float) n_pixels;
-      temp_array [index + 2] /= (float) n_pixels;
+    if (c == '-')
+    {
+      if (fscanf (fp, "%d", &b) != 1)
+        break;
+      c = fgetc (fp);
     }
+
+    for (i = a; i <= b && i < CPU_SETSIZE; i++)
+      CPU_SET (i, set);
+
+    if (c != ',')
+      break;
   }
 
-  memcpy (array, temp_array, image->width * image->height * 3 * sizeof (float));
-  free (temp_array);
+  fclose (fp);
+  return CPU_COUNT (set);
 }
-#endif
 
-static void
-calc_g (const Image *image, const float *image_array, float *g_array, int x, int y)
+static int *
+assign_numa_nodes (int n_workers)
 {
-  int pixel_index;
-  int pixel_offset;
-  int neighbor_offset;
-  const float maxC = 1.732050808;
+  cpu_set_t online;
+  int *node_ids, *worker_nodes;
+  int n_nodes = 0;
   int i;
 
-  pixel_index = x + (y * image->width);
-  pixel_offset = pixel_index * 3;
+  if (!read_cpu_list ("/sys/devices/system/node/online", &online))
+  {
+    CPU_ZERO (&online);
+    CPU_SET (0, &online);
+  }
 
-  for (i = 0; i < 8; i++)
+  node_ids = malloc (CPU_COUNT (&online) * sizeof (int));
+  for (i = 0; i < CPU_SETSIZE; i++)
   {
-    float C;
+    if (CPU_ISSET (i, &online))
+      node_ids [n_nodes++] = i;
+  }
 
-    if (x + nx8 [i] < 0 || x + nx8 [i] >= image->width ||
-        y + ny8 [i] < 0 || y + ny8 [i] >= image->height)
-      continue;
+  /* Consecutive workers share a node, so each node gets one block of rows */
+  worker_nodes = malloc (n_workers * sizeof (int));
+  for (i = 0; i < n_workers; i++)
+    worker_nodes [i] = node_ids [(long) i * n_nodes / n_workers];
 
-    neighbor_offset = (x + nx8 [i] + ((y + ny8 [i]) * image->width)) * 3;
+  free (node_ids);
+  return worker_nodes;
+}
 
-    C = sqrtf ((image_array [pixel_offset] - image_array [neighbor_offset]) * (image_array [pixel_offset] - image_array [neighbor_offset]) +
-               (image_array [pixel_offset + 1] - image_array [neighbor_offset + 1]) * (image_array [pixel_offset + 1] - image_array [neighbor_offset + 1]) +
-               (image_array [pixel_offset + 2] - image_array [neighbor_offset + 2]) * (image_array [pixel_offset + 2] - image_array [neighbor_offset + 2]));
-    g_array [pixel_index * 8 + i] = 1.0 - (C / maxC);
-  }
+static int
+read_node_cpus (int node, cpu_set_t *cpus)
+{
+  char path [64];
+
+  sprintf (path, "/sys/devices/system/node/node%d/cpulist", node);
+  return read_cpu_list (path, cpus);
 }
 
 static void
-process_file (Image *image, Image *overlay)
+pin_to_node (int node)
 {
-  float *image_array, *overlay_array_a, *overlay_array_b, *g_array;
-  const int max_iter = 2000;
-  int iter = 0;
-  int x, y;
+  cpu_set_t cpus;
 
-  image_array = malloc (image->width * image->height * 3 * sizeof (float));
-  overlay_array_a = malloc (image->width * image->height * sizeof (float));
-  overlay_array_b = malloc (image->width * image->height * sizeof (float));
-  g_array = malloc (image->width * image->height * 8 * sizeof (float));
+  if (read_node_cpus (node, &cpus))
+    pthread_setaffinity_np (pthread_self (), sizeof (cpus), &cpus);
+}
 
-  memset (image_array, 0, image->width * image->height * 3 * sizeof (float));
-  memset (overlay_array_a, 0, image->width * image->height * sizeof (float));
-  memset (overlay_array_b, 0, image->width * image->height * sizeof (float));
-#if 0
-  memset (g_array, 0, image->width * image->height * 8 * sizeof (float));
-#endif
+static void
+pin_to_cpu (int cpu)
+{
+  cpu_set_t cpus;
 
-  /* Init arrays */
+  CPU_ZERO (&cpus);
+  CPU_SET (cpu, &cpus);
+  pthread_setaffinity_np (pthread_self (), sizeof (cpus), &cpus);
+}
 
-  for (y = 0; y < image->height; y++)
+/* Lists the CPUs we're allowed to run on, a core at a time. With
+ * AFFINITY_CORE, only the first hardware thread of each core is listed, so
+ * no two workers share a core's execution units and caches. With
+ * AFFINITY_SMT, all threads are, siblings next to each other. Returns the
+ * number of CPUs listed. */
+static int
+list_worker_cpus (Affinity affinity, int *cpus)
+{
+  cpu_set_t allowed, listed;
+  int n_cpus = 0;
+  int i, j;
+
+  if (sched_getaffinity (0, sizeof (allowed), &allowed) != 0)
+    return 0;
+
+  CPU_ZERO (&listed);
+
+  for (i = 0; i < CPU_SETSIZE; i++)
   {
-    for (x = 0; x < image->width; x++)
+    char path [96];
+    cpu_set_t siblings;
+
+    if (!CPU_ISSET (i, &allowed) || CPU_ISSET (i, &listed))
+      continue;
+
+    sprintf (path, "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list", i);
+    if (!read_cpu_list (path, &siblings))
     {
-      png_byte image_pixel [4];
-      png_byte overlay_pixel [4];
+      CPU_ZERO (&siblings);
+      CPU_SET (i, &siblings);
+    }
 
-      get_pixel (image, x, y, image_pixel);
-      get_pixel (overlay, x, y, overlay_pixel);
+    /* i is the core's first allowed thread */
+    for (j = i; j < CPU_SETSIZE; j++)
+    {
+      if (!CPU_ISSET (j, &siblings) || !CPU_ISSET (j, &allowed))
+        continue;
 
-      image_array [(x + y * image->width) * 3]     = (float) image_pixel [0] / 255.0;
-      image_array [(x + y * image->width) * 3 + 1] = (float) image_pixel [1] / 255.0;
-      image_array [(x + y * image->width) * 3 + 2] = (float) image_pixel [2] / 255.0;
+      CPU_SET (j, &listed);
+      if (affinity == AFFINITY_SMT || j == i)
+        cpus [n_cpus++] = j;
+    }
+  }
 
-      if (overlay_pixel [3] > 0x80)
+  return n_cpus;
+}
+
+/* Gives each worker a CPU of its own while they last. With --numa, workers
+ * get CPUs on their node. */
+static int *
+assign_worker_cpus (int n_workers, Affinity affinity, const int *worker_nodes)
+{
+  int *cpus, *candidates, *worker_cpus;
+  int n_cpus, n_candidates = 0;
+  int node_first = 0;
+  int i, j;
+
+  cpus = malloc (CPU_SETSIZE * sizeof (int));
+  candidates = malloc (CPU_SETSIZE * sizeof (int));
+  n_cpus = list_worker_cpus (affinity, cpus);
+
+  if (n_cpus == 0)
+  {
+    free (cpus);
+    free (candidates);
+    return NULL;
+  }
+
+  worker_cpus = malloc (n_workers * sizeof (int));
+
+  for (i = 0; i < n_workers; i++)
+  {
+    /* Workers on a node are consecutive */
+    if (worker_nodes && (i == 0 || worker_nodes [i] != worker_nodes [i - 1]))
+    {
+      cpu_set_t node_cpus;
+
+      node_first = i;
+      n_candidates = 0;
+
+      if (read_node_cpus (worker_nodes [i], &node_cpus))
       {
-        if ((int) overlay_pixel [0] > (int) overlay_pixel [1] + 128)
-        {
-          /* Red, background */
-          overlay_array_a [x + y * image->width] = -1.0;
-        }
-        else
+        for (j = 0; j < n_cpus; j++)
         {
-          /* Green, foreground */
-          overlay_array_a [x + y * image->width] = 1.0;
+          if (CPU_ISSET (cpus [j], &node_cpus))
+            candidates [n_candidates++] = cpus [j];
         }
       }
     }
+
+    if (n_candidates > 0)
+      worker_cpus [i] = candidates [(i - node_first) % n_candidates];
+    else
+      worker_cpus [i] = cpus [i % n_cpus];
   }
 
-  blur_image_array (image, image_array);
+  free (cpus);
+  free (candidates);
+  return worker_cpus;
+}
 
-  for (y = 0; y < image->height; y++)
-  {
-    for (x = 0; x < image->width; x++)
-      calc_g (image, image_array, g_array, x, y);
-  }
+static void *
+worker_main (Worker *worker)
+{
+  WorkerPool *pool = worker->pool;
+  unsigned int generation = 0;
 
-  /* Process */
+  if (pool->worker_cpus)
+    pin_to_cpu (pool->worker_cpus [worker->index]);
+  else if (pool->worker_nodes)
+    pin_to_node (pool->worker_nodes [worker->index]);
+
+  pthread_mutex_lock (&pool->mutex);
 
-  while (!process_iteration (image, image_array, overlay_array_a, overlay_array_b, g_array) &&
-         (++iter < max_iter))
+  for (;;)
   {
-    float *tmp_array;
+    PoolFunc func;
+    void *data;
+
+    while (pool->generation == generation && !pool->quit)
+      pthread_cond_wait (&pool->work_cond, &pool->mutex);
+
+    if (pool->quit)
+      break;
 
-    tmp_array = overlay_array_a;
-    overlay_array_a = overlay_array_b;
-    overlay_array_b = tmp_array;
+    generation = pool->generation;
+    func = pool->func;
+    data = pool->data;
+    pthread_mutex_unlock (&pool->mutex);
+
+    func (worker->index, pool->n_workers, data);
+
+    pthread_mutex_lock (&pool->mutex);
+    if (--pool->n_busy == 0)
+      pthread_cond_signal (&pool->done_cond);
   }
 
-  /* Generate alpha from arrays */
+  pthread_mutex_unlock (&pool->mutex);
+  return NULL;
+}
 
-  for (y = 0; y < image->height; y++)
-  {
-    for (x = 0; x < image->width; x++)
-    {
-      png_byte image_pixel [4];
+static WorkerPool *
+pool_new (const Options *options)
+{
+  WorkerPool *pool;
+  int i;
 
-      get_pixel (image, x, y, image_pixel);
-      image_pixel [3] = overlay_array_b [x + (y * image->width)] > 0.0 ? 0xff : 0x00;
+  pool = calloc (1, sizeof (WorkerPool));
+  pool->n_workers = options->n_threads;
+  pool->workers = malloc (pool->n_workers * sizeof (Worker));
+  pool->threads = malloc (pool->n_workers * sizeof (pthread_t));
 
-#ifdef SHOW_EFFECTS
-      image_pixel [0] = image_array [(x + (y * image->width)) * 3] * 255.0;
-      image_pixel [1] = image_array [(x + (y * image->width)) * 3 + 1] * 255.0;
-      image_pixel [2] = image_array [(x + (y * image->width)) * 3 + 2] * 255.0;
-#endif
+  pthread_mutex_init (&pool->mutex, NULL);
+  pthread_cond_init (&pool->work_cond, NULL);
+  pthread_cond_init (&pool->done_cond, NULL);
+  pthread_cond_init (&pool->barrier_cond, NULL);
 
-      set_pixel (image, x, y, image_pixel);
-    }
+  if (options->numa)
+    pool->worker_nodes = assign_numa_nodes (pool->n_workers);
+  pool->affinity = options->affinity;
+  if (options->affinity != AFFINITY_NONE)
+    pool->worker_cpus = assign_worker_cpus (pool->n_workers, options->affinity, pool->worker_nodes);
+
+  for (i = 0; i < pool->n_workers; i++)
+  {
+    pool->workers [i].pool = pool;
+    pool->workers [i].index = i;
+    pthread_create (&pool->threads [i], NULL, (void *(*)(void *)) worker_main, &pool->workers [i]);
   }
+
+  return pool;
 }
 
-int
-main (int argc, char **argv)
+static void
+pool_run (WorkerPool *pool, PoolFunc func, void *data)
 {
-  Image image;
-  Image overlay;
+  pthread_mutex_lock (&pool->mutex);
 
-  if (argc != 4)
-    abort_ ("Usage: %s <image_in> <overlay_in> <image_out>", argv [0]);
+  pool->func = func;
+  pool->data = data;
+  pool->n_busy = pool->n_workers;
+  pool->generation++;
+  pthread_cond_broadcast (&pool->work_cond);
 
-  read_png_file (argv [1], &image);
-  read_png_file (argv [2], &overlay);
+  while (pool->n_busy > 0)
+    pthread_cond_wait (&pool->done_cond, &pool->mutex);
 
-  process_file (&image, &overlay);
+  pthread_mutex_unlock (&pool->mutex);
+}
 
-  write_png_file (&image, argv [3]);
+/* Called by every worker in a pool function. Waits for all of them to get
+ * here, then runs func in the last to arrive before letting them go on, so
+ * func sees everything the workers did and they see what it did. */
+static void
+pool_barrier (WorkerPool *pool, void (*func) (void *data), void *data)
+{
+  unsigned int generation;
 
-  return 0;
+  pthread_mutex_lock (&pool->mutex);
+
+  generation = pool->barrier_generation;
+
+  if (++pool->n_arrived == pool->n_workers)
+  {
+    func (data);
+    pool->n_arrived = 0;
+    pool->barrier_generation++;
+    pthread_cond_broadcast (&pool->barrier_cond);
+  }
+  else
+  {
+    while (pool->barrier_generation == generation)
+      pthread_cond_wait (&pool->barrier_cond, &pool->mutex);
+  }
+
+  pthread_mutex_unlock (&pool->mutex);
+}
+
+static void
+pool_free (WorkerPool *pool)
+{
+  int i;
+
+  pthread_mutex_lock (&pool->mutex);
+  pool->quit = 1;
+  pthread_cond_broadcast (&pool->work_cond);
+  pthread_mutex_unlock (&pool->mutex);
+
+  for (i = 0; i < pool->n_workers; i++)
+    pthread_join (pool->threads [i], NULL);
+
+  pthread_mutex_destroy (&pool->mutex);
+  pthread_cond_destroy (&pool->work_cond);
+  pthread_cond_destroy (&pool->done_cond);
+  pthread_cond_destroy (&pool->barrier_cond);
+
+  free (pool->worker_nodes);
+  free (pool->worker_cpus);
+  free (pool->workers);
+  free (pool->threads);
+  free (pool);
+}
+
+/* Replaces *pool if it doesn't have the number of workers or the affinity
+ * options asks for */
+static void
+pool_ensure (WorkerPool **pool, const Options *options)
+{
+  if ((*pool)->n_workers == options->n_threads && (*pool)->affinity == options->affinity)
+    return;
+
+  pool_free (*pool);
+  *pool = pool_new (options);
+}
+
+#else
+
+struct WorkerPool
+{
+  int n_workers;
+};
+
+static WorkerPool *
+pool_new (const Options *options)
+{
+  WorkerPool *pool;
+
+  pool = malloc (sizeof (WorkerPool));
+  pool->n_workers = 1;
+  return pool;
+}
+
+static void
+pool_run (WorkerPool *pool, PoolFunc func, void *data)
+{
+  func (0, 1, data);
+}
+
+static void
+pool_barrier (WorkerPool *pool, void (*func) (void *data), void *data)
+{
+  func (data);
+}
+
+static void
+pool_ensure (WorkerPool **pool, const Options *options)
+{
+}
+
+static void
+pool_free (WorkerPool *pool)
+{
+  free (pool);
+}
+
+#endif
+
+/* Cancellation
+ * ------------
+ *
+ * A job can be stopped before it's done: by SIGUSR1, which a front end can
+ * send when a newer request supersedes the one in progress, or when it runs
+ * past --deadline. Preprocessing checks between passes, out of core after
+ * each tile, and the solvers at each iteration, out of core also before
+ * each tile. A stopped job writes no output, and the workers and the arena
+ * go straight on to the next one. With --checkpoint, what it got done is
+ * saved first. */
+
+typedef enum
+{
+  CANCEL_NONE,
+  CANCEL_REQUESTED,  /* By signal */
+  CANCEL_DEADLINE,   /* Ran out of time */
+  CANCEL_PREEMPTED   /* To make way for a more urgent job */
+}
+CancelReason;
+
+struct CancelToken
+{
+  /* A CancelReason; set by the signal handler, once the deadline passes, or
+   * by the batch reader to preempt the job. Only ever accessed atomically,
+   * with cancel_reason () and cancel_token_raise (). */
+  sig_atomic_t reason;
+
+  /* now () time the job must be done by, or 0 for none */
+  double deadline;
+};
+
+/* Token of the job in progress, for the signal handler */
+static CancelToken * volatile current_cancel;
+
+static double
+now (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static CancelReason
+cancel_reason (const CancelToken *token)
+{
+  return __atomic_load_n (&token->reason, __ATOMIC_ACQUIRE);
+}
+
+/* Sets the reason the job is stopped, unless it's already being stopped for
+ * another */
+static void
+cancel_token_raise (CancelToken *token, CancelReason reason)
+{
+  sig_atomic_t expected = CANCEL_NONE;
+
+  __atomic_compare_exchange_n (&token->reason, &expected, reason, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+
+/* A request from the front end wins over any other reason */
+static void
+cancel_signal_handler (int signum)
+{
+  CancelToken *token = current_cancel;
+
+  (void) signum;
+
+  if (token)
+    __atomic_store_n (&token->reason, CANCEL_REQUESTED, __ATOMIC_RELEASE);
+}
+
+static void
+cancel_token_init (CancelToken *token, int deadline)
+{
+  __atomic_store_n (&token->reason, CANCEL_NONE, __ATOMIC_RELEASE);
+  token->deadline = deadline > 0 ? now () + deadline : 0.0;
+}
+
+/* Returns nonzero if the job should stop. Passing the deadline counts as a
+ * cancellation from then on. */
+static int
+job_cancelled (CancelToken *token)
+{
+  if (!token)
+    return 0;
+
+  if (cancel_reason (token) == CANCEL_NONE && token->deadline > 0.0 && now () >= token->deadline)
+    cancel_token_raise (token, CANCEL_DEADLINE);
+
+  return cancel_reason (token) != CANCEL_NONE;
+}
+
+/* Work stealing
+ * -------------
+ *
+ * Work that can take uneven time, like rows where a thread is interrupted,
+ * is split into tasks [0, n_tasks). Each worker starts on the contiguous
+ * share it would have had anyway, taking tasks from the front, so without
+ * stealing every row is still processed by the thread that first touched it.
+ * A worker whose share runs out steals from the back of the others'.
+ *
+ * Each worker's remaining share is a range packed into one 64-bit word, so
+ * owner and thieves settle races with a single compare-and-swap. */
+
+typedef struct
+{
+  /* First task in the low 32 bits, end in the high 32 bits */
+  uint64_t range;
+  char padding [CACHE_LINE_SIZE - sizeof (uint64_t)];
+}
+TaskDeque;
+
+typedef struct
+{
+  TaskDeque *deques;
+  int n_deques;
+  int n_tasks;
+}
+TaskQueue;
+
+static size_t
+task_queue_arena_size (int n_workers)
+{
+  return arena_round (n_workers * sizeof (TaskDeque));
+}
+
+static void
+task_queue_init (TaskQueue *queue, int n_workers, Arena *arena)
+{
+  queue->deques = arena_alloc (arena, n_workers * sizeof (TaskDeque));
+  queue->n_deques = n_workers;
+  queue->n_tasks = 0;
+}
+
+/* Must be called while the workers are idle */
+static void
+task_queue_reset (TaskQueue *queue, int n_tasks)
+{
+  int i;
+
+  queue->n_tasks = n_tasks;
+
+  for (i = 0; i < queue->n_deques; i++)
+  {
+    int t0, t1;
+
+    worker_rows (i, queue->n_deques, 0, n_tasks, &t0, &t1);
+    queue->deques [i].range = (uint64_t) t1 << 32 | (uint32_t) t0;
+  }
+}
+
+/* Takes the first task from deque, or the last if steal is set. Returns -1
+ * if it was empty. */
+static int
+task_deque_take (TaskDeque *deque, int steal)
+{
+  uint64_t range = __atomic_load_n (&deque->range, __ATOMIC_ACQUIRE);
+
+  for (;;)
+  {
+    uint32_t t0 = (uint32_t) range, t1 = range >> 32;
+    uint64_t new_range;
+
+    if (t0 >= t1)
+      return -1;
+
+    new_range = steal ? (uint64_t) (t1 - 1) << 32 | t0 : (uint64_t) t1 << 32 | (t0 + 1);
+
+    /* On failure, range is updated and we retry */
+    if (__atomic_compare_exchange_n (&deque->range, &range, new_range, 0,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+      return steal ? (int) t1 - 1 : (int) t0;
+  }
+}
+
+/* Returns the next task for worker, or -1 when there are none left */
+static int
+task_queue_pop (TaskQueue *queue, int worker)
+{
+  int task, i;
+
+  task = task_deque_take (&queue->deques [worker], 0);
+  if (task >= 0)
+    return task;
+
+  for (i = 1; i < queue->n_deques; i++)
+  {
+    task = task_deque_take (&queue->deques [(worker + i) % queue->n_deques], 1);
+    if (task >= 0)
+      return task;
+  }
+
+  return -1;
+}
+
+/* What each worker reports from an iteration. Slots are a cache line each,
+ * so workers never write to a line another one is using. */
+typedef struct
+{
+  int converged;
+  char padding [CACHE_LINE_SIZE - sizeof (int)];
+}
+WorkerSlot;
+
+/* Rows [y0, y1) of arrays starting at image row row_base, split among workers */
+typedef struct
+{
+  const Image *image;
+  const void *overlay_array_in;
+  void *overlay_array_out;
+  const void *g_array;
+  ProcessRowsFunc process_rows;
+  int neighbor_index_ofs [8];
+
+  /* Number of seed sets whose strengths are interleaved in the arrays,
+   * padded to a multiple of SEED_SET_LANES. If more than one, they're
+   * processed with process_rows_sets instead. */
+  int n_sets;
+  ProcessRowsSetsFunc process_rows_sets;
+  int y0, y1;
+  int row_base;
+
+  /* If set, the arrays are in blocks, and all of them are processed with
+   * process_block instead of rows [y0, y1) */
+  const Layout *layout;
+  ProcessBlockFunc process_block;
+
+  /* Chunks of rows or blocks, balanced among the workers */
+  TaskQueue tasks;
+  WorkerPool *pool;
+
+  /* One per worker */
+  WorkerSlot *slots;
+
+  /* For solve_in_memory (): iterations done, set when the workers should
+   * stop, and set if that was because the job was cancelled */
+  int iterations;
+  int done;
+  int cancelled;
+  CancelToken *cancel;
+
+  /* If set, solve_in_memory () calls it after each iteration with the
+   * strengths so far */
+  void (*progress) (void *data, const void *strength, int iterations);
+  void *progress_data;
+}
+IterationArgs;
+
+static size_t
+iteration_arena_size (int n_workers)
+{
+  return arena_round (n_workers * sizeof (WorkerSlot)) + task_queue_arena_size (n_workers);
+}
+
+static void
+iteration_args_init (IterationArgs *args, const Image *image, const Options *options,
+                     WorkerPool *pool, Arena *arena)
+{
+  int i;
+
+  memset (args, 0, sizeof (IterationArgs));
+  args->image = image;
+  args->process_rows = kernels->process_rows [options->precision];
+  args->process_rows_sets = kernels->process_rows_sets [options->precision];
+  args->process_block = kernels->process_block [options->precision];
+  args->n_sets = 1;
+  args->y1 = image->height;
+  args->pool = pool;
+  args->cancel = options->cancel;
+  args->slots = arena_alloc (arena, pool->n_workers * sizeof (WorkerSlot));
+  task_queue_init (&args->tasks, pool->n_workers, arena);
+
+  for (i = 0; i < 8; i++)
+    args->neighbor_index_ofs [i] = nx8 [i] + ny8 [i] * image->width;
+}
+
+/* Processes tasks until there are none left */
+static void
+process_tasks (IterationArgs *args, int worker)
+{
+  int *converged = &args->slots [worker].converged;
+  int task;
+
+  while ((task = task_queue_pop (&args->tasks, worker)) >= 0)
+  {
+    int y0, y1;
+
+    if (args->layout)
+    {
+      int i;
+
+      worker_rows (task, args->tasks.n_tasks, 0, args->layout->n_blocks, &y0, &y1);
+
+      for (i = y0; i < y1; i++)
+        args->process_block (args->image, args->layout, &args->layout->blocks [i],
+                             args->overlay_array_in, args->overlay_array_out, args->g_array, converged);
+      continue;
+    }
+
+    worker_rows (task, args->tasks.n_tasks, args->y0, args->y1, &y0, &y1);
+
+    if (args->n_sets > 1)
+      args->process_rows_sets (args->image, y0, y1, args->row_base, args->n_sets,
+                               args->overlay_array_in, args->overlay_array_out, args->g_array,
+                               args->neighbor_index_ofs, converged);
+    else
+      args->process_rows (args->image, y0, y1, args->row_base, args->overlay_array_in,
+                          args->overlay_array_out, args->g_array, args->neighbor_index_ofs,
+                          converged);
+  }
+}
+
+/* Readies args for an iteration. Must be called while the workers are idle. */
+static void
+start_iteration (IterationArgs *args)
+{
+  int n_tasks = args->pool->n_workers * TASKS_PER_WORKER;
+  int n_units = args->layout ? args->layout->n_blocks : args->y1 - args->y0;
+  int i;
+
+  if (n_tasks > n_units)
+    n_tasks = n_units;
+
+  task_queue_reset (&args->tasks, n_tasks);
+
+  for (i = 0; i < args->pool->n_workers; i++)
+    args->slots [i].converged = 1;
+}
+
+static int
+iteration_converged (const IterationArgs *args)
+{
+  int converged = 1;
+  int i;
+
+  for (i = 0; i < args->pool->n_workers; i++)
+    converged &= args->slots [i].converged;
+
+  return converged;
+}
+
+static void
+process_iteration_worker (int worker, int n_workers, void *data)
+{
+  (void) n_workers;
+
+  process_tasks (data, worker);
+}
+
+/* Runs one iteration over rows [args->y0, args->y1) */
+static int
+process_iteration (WorkerPool *pool, IterationArgs *args)
+{
+  start_iteration (args);
+  pool_run (pool, process_iteration_worker, args);
+
+  return iteration_converged (args);
+}
+
+/* Runs in the last worker to finish an iteration */
+static void
+finish_iteration (void *data)
+{
+  IterationArgs *args = data;
+  void *tmp_array;
+
+  if (iteration_converged (args) || ++args->iterations >= MAX_ITER)
+  {
+    args->done = 1;
+    return;
+  }
+
+  /* overlay_array_out holds the result of args->iterations iterations */
+  if (job_cancelled (args->cancel))
+  {
+    args->cancelled = 1;
+    args->done = 1;
+    return;
+  }
+
+  tmp_array = (void *) args->overlay_array_in;
+  args->overlay_array_in = args->overlay_array_out;
+  args->overlay_array_out = tmp_array;
+
+  if (args->progress)
+    args->progress (args->progress_data, args->overlay_array_in, args->iterations);
+
+  start_iteration (args);
+}
+
+static void
+solve_worker (int worker, int n_workers, void *data)
+{
+  IterationArgs *args = data;
+
+  (void) n_workers;
+
+  while (!args->done)
+  {
+    process_tasks (args, worker);
+    pool_barrier (args->pool, finish_iteration, args);
+  }
+}
+
+/* Iterates until convergence in one go, without returning to the main thread
+ * between iterations. The workers meet at a barrier after each iteration,
+ * and the last to arrive checks for convergence and readies the next one.
+ * Counting starts from args->iterations, which is nonzero when resuming.
+ * Returns the number of iterations; the result is in overlay_array_out. If
+ * the job is cancelled, args->cancelled is set, and overlay_array_out holds
+ * the result of args->iterations iterations. */
+static int
+solve_in_memory (WorkerPool *pool, IterationArgs *args)
+{
+  args->done = 0;
+
+  start_iteration (args);
+  pool_run (pool, solve_worker, args);
+
+  return args->iterations + 1;
+}
+
+#if 0
+
+/* TODO: A further refinement would be to process in HSV color space, so we
+ * can apply different weights to hue, saturation and value. Typically, hue
+ * would have a higher weight. */
+
+static void
+image_array_to_hsv (Image *image, float *array)
+{
+  int x, y;
+  int i;
+
+  for (y = 0; y < image->height; y++)
+  {
+    for (x = 0; x < image->width; x++)
+    {
+      int index = (x + (y * image->width)) * 3;
+      int n_pixels = 0;
+
+      temp_array [index] /= (float) n_pixels;
+      temp_array [index + 1] /= (float) n_pixels;
+      temp_array [index + 2] /= (float) n_pixels;
+    }
+  }
+
+  memcpy (array, temp_array, image->width * image->height * 3 * sizeof (float));
+  free (temp_array);
+}
+#endif
+
+/* Soft alpha
+ * ----------
+ *
+ * The label boundary is found and dilated into a thin band. Pixels outside
+ * the band get hard alpha. Inside the band, alpha is estimated by projecting
+ * the pixel colour onto the line between the local foreground and background
+ * means, sampled from band-free pixels in a small window. Where the two means
+ * are too close to separate, we lean on the cell strength instead.
+ *
+ * This is done in three row-parallel passes: boundary detection with
+ * horizontal dilation, vertical dilation and classification, and finally
+ * alpha estimation. */
+
+enum
+{
+  CLASS_BAND,
+  CLASS_BACKGROUND,
+  CLASS_FOREGROUND
+};
+
+typedef struct
+{
+  Image *image;
+  const void *strength;
+  Precision precision;
+  unsigned char *hband;
+  unsigned char *class_map;
+  int radius;
+  int y0, y1;
+
+  /* Rows private to the worker, alpha_scratch_size () bytes */
+  unsigned char *scratch;
+}
+AlphaArgs;
+
+static size_t
+alpha_scratch_size (int width)
+{
+  /* Three padded label rows and a boundary or band row */
+  return arena_round ((size_t) (width + 2) * 3 + width);
+}
+
+static void
+label_row (const AlphaArgs *args, int y, unsigned char *labels)
+{
+  int width = args->image->width;
+  size_t index = (size_t) y * width;
+  int x;
+
+  /* Pad with the edge labels so the image border is never a boundary */
+
+  for (x = 0; x < width; x++)
+    labels [x + 1] = load_float (args->precision, args->strength, index + x) > 0.0;
+
+  labels [0] = labels [1];
+  labels [width + 1] = labels [width];
+}
+
+static void *
+alpha_boundary_thread (AlphaArgs *args)
+{
+  int width = args->image->width;
+  int height = args->image->height;
+  int radius = args->radius;
+  unsigned char *labels [3];
+  unsigned char *boundary;
+  int x, y, i;
+
+  for (i = 0; i < 3; i++)
+    labels [i] = args->scratch + (size_t) (width + 2) * i;
+  boundary = args->scratch + (size_t) (width + 2) * 3;
+
+  for (y = args->y0; y < args->y1; y++)
+  {
+    const unsigned char *above, *cur, *below;
+    unsigned char *hband = args->hband + (size_t) y * width;
+    int dist;
+
+    label_row (args, y > 0 ? y - 1 : y, labels [0]);
+    label_row (args, y, labels [1]);
+    label_row (args, y < height - 1 ? y + 1 : y, labels [2]);
+
+    above = labels [0] + 1;
+    cur = labels [1] + 1;
+    below = labels [2] + 1;
+
+    for (x = 0; x < width; x++)
+    {
+      boundary [x] = (cur [x] != cur [x - 1]) | (cur [x] != cur [x + 1])
+        | (cur [x] != above [x - 1]) | (cur [x] != above [x]) | (cur [x] != above [x + 1])
+        | (cur [x] != below [x - 1]) | (cur [x] != below [x]) | (cur [x] != below [x + 1]);
+    }
+
+    /* Horizontal dilation by two distance sweeps */
+
+    for (dist = radius + 1, x = 0; x < width; x++)
+    {
+      dist = boundary [x] ? 0 : (dist > radius ? dist : dist + 1);
+      hband [x] = dist <= radius;
+    }
+
+    for (dist = radius + 1, x = width - 1; x >= 0; x--)
+    {
+      dist = boundary [x] ? 0 : (dist > radius ? dist : dist + 1);
+      hband [x] |= dist <= radius;
+    }
+  }
+
+  return NULL;
+}
+
+static void *
+alpha_classify_thread (AlphaArgs *args)
+{
+  int width = args->image->width;
+  int height = args->image->height;
+  unsigned char *band;
+  int x, y;
+
+  band = args->scratch;
+
+  for (y = args->y0; y < args->y1; y++)
+  {
+    size_t index = (size_t) y * width;
+    unsigned char *class_map = args->class_map + index;
+    int yy0 = y - args->radius < 0 ? 0 : y - args->radius;
+    int yy1 = y + args->radius >= height ? height - 1 : y + args->radius;
+    int yy;
+
+    memset (band, 0, width);
+
+    for (yy = yy0; yy <= yy1; yy++)
+    {
+      const unsigned char *hband = args->hband + (size_t) yy * width;
+
+      for (x = 0; x < width; x++)
+        band [x] |= hband [x];
+    }
+
+    for (x = 0; x < width; x++)
+      class_map [x] = band [x] ? CLASS_BAND
+        : load_float (args->precision, args->strength, index + x) > 0.0 ? CLASS_FOREGROUND
+        : CLASS_BACKGROUND;
+  }
+
+  return NULL;
+}
+
+static float
+estimate_alpha (const AlphaArgs *args, int x, int y)
+{
+  const Image *image = args->image;
+  int width = image->width;
+  int window = 2 * args->radius + 1;
+  int x0 = x - window < 0 ? 0 : x - window;
+  int x1 = x + window >= width ? width - 1 : x + window;
+  int y0 = y - window < 0 ? 0 : y - window;
+  int y1 = y + window >= image->height ? image->height - 1 : y + window;
+  int fg_sum [3] = { 0, 0, 0 }, bg_sum [3] = { 0, 0, 0 };
+  int n_fg = 0, n_bg = 0;
+  float strength, strength_alpha, color_alpha, confidence;
+  float fg [3], bg [3], d [3], dot, denom;
+  const png_byte *pixel;
+  int xx, yy, c;
+
+  strength = load_float (args->precision, args->strength, (size_t) y * width + x);
+  strength = strength < -1.0 ? -1.0 : strength > 1.0 ? 1.0 : strength;
+  strength_alpha = 0.5 + 0.5 * strength;
+
+  /* Branchless so it vectorizes */
+
+  for (yy = y0; yy <= y1; yy++)
+  {
+    const png_byte *row = image->rows [yy];
+    const unsigned char *class_map = args->class_map + (size_t) yy * width;
+
+    for (xx = x0; xx <= x1; xx++)
+    {
+      int is_fg = class_map [xx] == CLASS_FOREGROUND;
+      int is_bg = class_map [xx] == CLASS_BACKGROUND;
+
+      n_fg += is_fg;
+      n_bg += is_bg;
+      fg_sum [0] += is_fg * row [xx * 4];
+      fg_sum [1] += is_fg * row [xx * 4 + 1];
+      fg_sum [2] += is_fg * row [xx * 4 + 2];
+      bg_sum [0] += is_bg * row [xx * 4];
+      bg_sum [1] += is_bg * row [xx * 4 + 1];
+      bg_sum [2] += is_bg * row [xx * 4 + 2];
+    }
+  }
+
+  if (n_fg == 0 || n_bg == 0)
+    return strength_alpha;
+
+  pixel = image->rows [y] + x * 4;
+  dot = denom = 0.0;
+
+  for (c = 0; c < 3; c++)
+  {
+    fg [c] = (float) fg_sum [c] / (float) n_fg;
+    bg [c] = (float) bg_sum [c] / (float) n_bg;
+    d [c] = fg [c] - bg [c];
+    dot += ((float) pixel [c] - bg [c]) * d [c];
+    denom += d [c] * d [c];
+  }
+
+  if (denom < 1.0)
+    return strength_alpha;
+
+  color_alpha = dot / denom;
+  color_alpha = color_alpha < 0.0 ? 0.0 : color_alpha > 1.0 ? 1.0 : color_alpha;
+  confidence = denom / (denom + SOFT_ALPHA_COLOR_SEPARATION * SOFT_ALPHA_COLOR_SEPARATION);
+
+  return confidence * color_alpha + (1.0 - confidence) * strength_alpha;
+}
+
+static void *
+alpha_estimate_thread (AlphaArgs *args)
+{
+  int width = args->image->width;
+  int x, y;
+
+  for (y = args->y0; y < args->y1; y++)
+  {
+    png_byte *row = args->image->rows [y];
+    size_t index = (size_t) y * width;
+
+    if (!args->class_map)
+    {
+      kernels->strength_to_alpha_row [args->precision] ((const char *) args->strength
+                                                        + index * precision_size (args->precision),
+                                                        row, width);
+      continue;
+    }
+
+    for (x = 0; x < width; x++)
+    {
+      int class = args->class_map [(size_t) y * width + x];
+
+      if (class == CLASS_BAND)
+        row [x * 4 + 3] = (png_byte) (estimate_alpha (args, x, y) * 255.0 + 0.5);
+      else
+        row [x * 4 + 3] = class == CLASS_FOREGROUND ? 0xff : 0x00;
+    }
+  }
+
+  return NULL;
+}
+
+typedef struct
+{
+  const AlphaArgs *template;
+  void *(*func) (AlphaArgs *);
+}
+AlphaPass;
+
+static void
+alpha_pass_worker (int worker, int n_workers, void *data)
+{
+  const AlphaPass *pass = data;
+  AlphaArgs args = *pass->template;
+
+  worker_rows (worker, n_workers, 0, args.image->height, &args.y0, &args.y1);
+  if (args.scratch)
+    args.scratch += (size_t) worker * alpha_scratch_size (args.image->width);
+  pass->func (&args);
+}
+
+static void
+run_alpha_pass (WorkerPool *pool, const AlphaArgs *template, void *(*func) (AlphaArgs *))
+{
+  AlphaPass pass;
+
+  pass.template = template;
+  pass.func = func;
+  pool_run (pool, alpha_pass_worker, &pass);
+}
+
+static size_t
+alpha_arena_size (int width, int height, int radius, int n_workers)
+{
+  if (radius == 0)
+    return 0;
+
+  return arena_round ((size_t) width * height) * 2
+    + n_workers * alpha_scratch_size (width);
+}
+
+static void
+generate_alpha (WorkerPool *pool, Arena *arena, Image *image, const void *strength,
+                Precision precision, int radius)
+{
+  AlphaArgs args;
+
+  args.image = image;
+  args.strength = strength;
+  args.precision = precision;
+  args.radius = radius;
+  args.hband = NULL;
+  args.class_map = NULL;
+  args.scratch = NULL;
+
+  if (radius > 0)
+  {
+    args.hband = arena_alloc (arena, (size_t) image->width * image->height);
+    args.class_map = arena_alloc (arena, (size_t) image->width * image->height);
+    args.scratch = arena_alloc (arena, pool->n_workers * alpha_scratch_size (image->width));
+
+    run_alpha_pass (pool, &args, alpha_boundary_thread);
+    run_alpha_pass (pool, &args, alpha_classify_thread);
+  }
+
+  run_alpha_pass (pool, &args, alpha_estimate_thread);
+}
+
+/* Result cache
+ * ------------
+ *
+ * With --cache-dir, each job's alpha is saved in a file named after a hash
+ * of its decoded pixels, its seeds and the options that affect the result,
+ * and a later job with the same key takes its alpha from there instead of
+ * being solved. The thread count, kernel set and the other speed options
+ * don't change the result, so they're not part of the key.
+ *
+ * The alpha is stored as runs of equal values, which for a hard mask takes a
+ * few bytes per boundary crossing.
+ *
+ * The edge weights only depend on the image, so they're cached too, for jobs
+ * that segment the same image with new seeds. A weight is the same seen from
+ * either end of its edge, so only the four forward directions of each pixel
+ * are stored, in the job's storage format. The entry is mapped and the other
+ * four directions filled in from the neighbors, which is exact.
+ *
+ * Entries are touched when used, and the least recently used ones are
+ * removed when the cache grows past --cache-size. */
+
+typedef struct
+{
+  uint64_t h [2];
+}
+CacheKey;
+
+/* Four independent lanes keep the multiplier busy */
+static inline uint64_t
+hash_round (uint64_t h, uint64_t v)
+{
+  h ^= v * 0x9e3779b97f4a7c15ull;
+  h = (h << 31) | (h >> 33);
+  return h * 0xc2b2ae3d27d4eb4full;
+}
+
+static inline uint64_t
+hash_final (uint64_t h)
+{
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdull;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ull;
+  return h ^ (h >> 33);
+}
+
+static void
+hash_bytes (uint64_t *lanes, const png_byte *p, size_t n)
+{
+  uint64_t v [4];
+  size_t i;
+  int k;
+
+  for (i = 0; i + 32 <= n; i += 32)
+  {
+    memcpy (v, p + i, 32);
+    for (k = 0; k < 4; k++)
+      lanes [k] = hash_round (lanes [k], v [k]);
+  }
+
+  for (; i < n; i++)
+    lanes [i & 3] = hash_round (lanes [i & 3], p [i] | 0x100);
+}
+
+/* Hashes n_params ints and then the pixels of image into *key, starting from
+ * the key it holds */
+static void
+cache_hash (CacheKey *key, const int *params, int n_params, const Image *image)
+{
+  uint64_t lanes [4];
+  int y;
+
+  lanes [0] = key->h [0];
+  lanes [1] = key->h [1];
+  lanes [2] = ~key->h [0];
+  lanes [3] = ~key->h [1];
+
+  hash_bytes (lanes, (const png_byte *) params, n_params * sizeof (int));
+
+  for (y = 0; y < image->height; y++)
+    hash_bytes (lanes, image->rows [y], (size_t) image->width * 4);
+
+  key->h [0] = hash_final (lanes [0] ^ hash_final (lanes [1]));
+  key->h [1] = hash_final (lanes [2] ^ hash_final (lanes [3] ^ key->h [0]));
+}
+
+/* Key of the job's edge weights */
+static void
+cache_image_key (CacheKey *key, const Image *image, const Options *options)
+{
+  int params [4];
+
+  params [0] = CACHE_VERSION;
+  params [1] = image->width;
+  params [2] = image->height;
+  params [3] = options->precision;
+
+  memset (key, 0, sizeof (CacheKey));
+  cache_hash (key, params, 4, image);
+}
+
+/* Key of the job's result, given the key of its image */
+static void
+cache_result_key (CacheKey *key, const CacheKey *image_key, const Image *overlay,
+                  const Options *options)
+{
+  int params [1];
+
+  params [0] = options->soft_alpha_radius;
+
+  *key = *image_key;
+  cache_hash (key, params, 1, overlay);
+}
+
+static void
+cache_entry_path (char *path, const Options *options, const CacheKey *key, const char *suffix)
+{
+  if (snprintf (path, PATH_MAX, "%s/%016llx%016llx%s", options->cache_dir,
+                (unsigned long long) key->h [0], (unsigned long long) key->h [1], suffix) >= PATH_MAX)
+    abort_ ("Cache directory name too long: %s", options->cache_dir);
+}
+
+static int
+has_suffix (const char *s, const char *suffix)
+{
+  size_t len = strlen (s), suffix_len = strlen (suffix);
+
+  return len > suffix_len && !strcmp (s + len - suffix_len, suffix);
+}
+
+static int
+read_fully (int fd, void *buf, size_t size)
+{
+  char *p = buf;
+
+  while (size > 0)
+  {
+    ssize_t n = read (fd, p, size);
+
+    if (n <= 0)
+    {
+      if (n < 0 && errno == EINTR)
+        continue;
+      return 0;
+    }
+
+    p += n;
+    size -= n;
+  }
+
+  return 1;
+}
+
+/* Entry layout: the key and the dimensions, then runs of alpha, each a
+ * varint holding the run length minus one followed by the value */
+typedef struct
+{
+  CacheKey key;
+  int32_t width, height;
+}
+CacheHeader;
+
+/* Decodes the runs between p and end into the alpha of image, and returns
+ * nonzero if they cover it exactly */
+static int
+cache_decode (const png_byte *p, const png_byte *end, Image *image)
+{
+  int x = 0, y = 0;
+
+  while (y < image->height)
+  {
+    size_t run = 0;
+    int shift = 0;
+
+    while (p < end && *p & 0x80 && shift < 56)
+    {
+      run |= (size_t) (*p++ & 0x7f) << shift;
+      shift += 7;
+    }
+
+    if (p + 2 > end || *p & 0x80)
+      return 0;
+
+    run = (run | (size_t) *p++ << shift) + 1;
+
+    for (; run > 0 && y < image->height; run--)
+    {
+      image->rows [y][x * 4 + 3] = *p;
+      if (++x == image->width)
+      {
+        x = 0;
+        y++;
+      }
+    }
+
+    if (run > 0)
+      return 0;
+    p++;
+  }
+
+  return p == end;
+}
+
+/* Fills in the alpha of image from the entry for key and returns nonzero, or
+ * returns zero if there is no usable entry */
+static int
+cache_fetch_alpha (const Options *options, const CacheKey *key, Image *image)
+{
+  char path [PATH_MAX];
+  CacheHeader header;
+  struct stat st;
+  png_byte *data;
+  int fd, ok;
+
+  cache_entry_path (path, options, key, CACHE_ALPHA_SUFFIX);
+
+  fd = open (path, O_RDONLY);
+  if (fd < 0)
+    return 0;
+
+  if (fstat (fd, &st) != 0 || st.st_size < (off_t) sizeof (header)
+      || !(data = malloc (st.st_size)))
+  {
+    close (fd);
+    return 0;
+  }
+
+  ok = read_fully (fd, data, st.st_size);
+
+  if (ok)
+  {
+    memcpy (&header, data, sizeof (header));
+    ok = !memcmp (&header.key, key, sizeof (CacheKey))
+      && header.width == image->width && header.height == image->height
+      && cache_decode (data + sizeof (header), data + st.st_size, image);
+  }
+
+  /* Mark it as recently used */
+  if (ok)
+    futimens (fd, NULL);
+
+  close (fd);
+  free (data);
+
+  if (!ok)
+  {
+    fprintf (stderr, "Removing damaged cache entry %s\n", path);
+    unlink (path);
+  }
+
+  return ok;
+}
+
+static png_byte *
+put_varint (png_byte *p, size_t n)
+{
+  while (n >= 0x80)
+  {
+    *p++ = (n & 0x7f) | 0x80;
+    n >>= 7;
+  }
+
+  *p++ = n;
+  return p;
+}
+
+typedef struct
+{
+  char name [NAME_MAX + 1];
+  off_t size;
+  struct timespec mtime;
+}
+CacheEntry;
+
+static int
+compare_cache_entries (const void *a, const void *b)
+{
+  const CacheEntry *ea = a, *eb = b;
+
+  if (ea->mtime.tv_sec != eb->mtime.tv_sec)
+    return ea->mtime.tv_sec < eb->mtime.tv_sec ? -1 : 1;
+  if (ea->mtime.tv_nsec != eb->mtime.tv_nsec)
+    return ea->mtime.tv_nsec < eb->mtime.tv_nsec ? -1 : 1;
+  return 0;
+}
+
+/* Removes the least recently used entries until the cache fits in
+ * options->cache_size */
+static void
+cache_evict (const Options *options)
+{
+  CacheEntry *entries = NULL;
+  size_t n_entries = 0, n_allocated = 0;
+  off_t total = 0;
+  struct dirent *dirent;
+  size_t i;
+  DIR *dir;
+
+  dir = opendir (options->cache_dir);
+  if (!dir)
+    return;
+
+  while ((dirent = readdir (dir)))
+  {
+    struct stat st;
+
+    if ((!has_suffix (dirent->d_name, CACHE_ALPHA_SUFFIX)
+         && !has_suffix (dirent->d_name, CACHE_WEIGHTS_SUFFIX))
+        || fstatat (dirfd (dir), dirent->d_name, &st, 0) != 0)
+      continue;
+
+    if (n_entries == n_allocated)
+    {
+      n_allocated = n_allocated ? n_allocated * 2 : 64;
+      entries = realloc (entries, n_allocated * sizeof (CacheEntry));
+      if (!entries)
+        abort_ ("Could not allocate memory for the cache index");
+    }
+
+    strcpy (entries [n_entries].name, dirent->d_name);
+    entries [n_entries].size = st.st_size;
+    entries [n_entries].mtime = st.st_mtim;
+    total += st.st_size;
+    n_entries++;
+  }
+
+  if (total > (off_t) options->cache_size)
+  {
+    qsort (entries, n_entries, sizeof (CacheEntry), compare_cache_entries);
+
+    for (i = 0; i < n_entries && total > (off_t) options->cache_size; i++)
+    {
+      if (unlinkat (dirfd (dir), entries [i].name, 0) == 0)
+        total -= entries [i].size;
+    }
+  }
+
+  closedir (dir);
+  free (entries);
+}
+
+static void
+cache_header_init (CacheHeader *header, const CacheKey *key, const Image *image)
+{
+  memset (header, 0, sizeof (CacheHeader));
+  header->key = *key;
+  header->width = image->width;
+  header->height = image->height;
+}
+
+static int
+write_fully (int fd, const void *buf, size_t size)
+{
+  const char *p = buf;
+
+  while (size > 0)
+  {
+    ssize_t n = write (fd, p, size);
+
+    if (n < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      return 0;
+    }
+
+    p += n;
+    size -= n;
+  }
+
+  return 1;
+}
+
+/* Entries are written under a temporary name and renamed, so concurrent runs
+ * sharing the cache never see a partial one. Returns the file to write the
+ * entry to, or -1 on failure. */
+static int
+cache_entry_create (const Options *options, const CacheKey *key, const char *suffix,
+                    char *path, char *temp_path)
+{
+  cache_entry_path (path, options, key, suffix);
+  if (snprintf (temp_path, PATH_MAX, "%s.%d.tmp", path, (int) getpid ()) >= PATH_MAX)
+    abort_ ("Cache directory name too long: %s", options->cache_dir);
+
+  return open (temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+}
+
+/* Closes the entry and puts it in place if ok. Failures only cost a later
+ * lookup, so they're reported and otherwise ignored. */
+static void
+cache_entry_commit (const Options *options, int fd, int ok, const char *path, const char *temp_path)
+{
+  if (fd >= 0)
+  {
+    ok = close (fd) == 0 && ok;
+    ok = ok && rename (temp_path, path) == 0;
+  }
+
+  if (!ok || fd < 0)
+  {
+    fprintf (stderr, "Could not write cache entry %s: %s\n", path, strerror (errno));
+    unlink (temp_path);
+  }
+
+  cache_evict (options);
+}
+
+/* Saves the alpha of image as the entry for key */
+static void
+cache_store_alpha (const Options *options, const CacheKey *key, const Image *image)
+{
+  char path [PATH_MAX], temp_path [PATH_MAX];
+  size_t n_pixels = (size_t) image->width * image->height;
+  CacheHeader header;
+  png_byte *data, *p;
+  png_byte value = 0;
+  size_t run = 0;
+  int x, y, fd, ok;
+
+  /* Worst case is a run per pixel, each two bytes */
+  data = malloc (sizeof (header) + n_pixels * 2);
+  if (!data)
+    abort_ ("Could not allocate memory for the cache entry");
+
+  cache_header_init (&header, key, image);
+  memcpy (data, &header, sizeof (header));
+  p = data + sizeof (header);
+
+  for (y = 0; y < image->height; y++)
+  {
+    for (x = 0; x < image->width; x++)
+    {
+      png_byte alpha = image->rows [y][x * 4 + 3];
+
+      if (run > 0 && alpha != value)
+      {
+        p = put_varint (p, run - 1);
+        *p++ = value;
+        run = 0;
+      }
+
+      value = alpha;
+      run++;
+    }
+  }
+
+  if (run > 0)
+  {
+    p = put_varint (p, run - 1);
+    *p++ = value;
+  }
+
+  fd = cache_entry_create (options, key, CACHE_ALPHA_SUFFIX, path, temp_path);
+  ok = fd >= 0 && write_fully (fd, data, p - data);
+  cache_entry_commit (options, fd, ok, path, temp_path);
+
+  free (data);
+}
+
+/* Maps the weights entry for key, or returns NULL if there is none. The
+ * stored weights start at sizeof (CacheHeader) into the mapping. */
+static png_byte *
+cache_map_weights (const Options *options, const CacheKey *key, const Image *image,
+                   size_t *map_size)
+{
+  size_t size = sizeof (CacheHeader)
+    + (size_t) image->width * image->height * 4 * precision_size (options->precision);
+  char path [PATH_MAX];
+  CacheHeader header;
+  struct stat st;
+  png_byte *map;
+  int fd;
+
+  cache_entry_path (path, options, key, CACHE_WEIGHTS_SUFFIX);
+
+  fd = open (path, O_RDONLY);
+  if (fd < 0)
+    return NULL;
+
+  map = NULL;
+  if (fstat (fd, &st) == 0 && (size_t) st.st_size == size)
+  {
+    map = mmap (NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED)
+      map = NULL;
+  }
+
+  cache_header_init (&header, key, image);
+
+  if (map && memcmp (map, &header, sizeof (header)))
+  {
+    munmap (map, size);
+    map = NULL;
+  }
+
+  if (map)
+  {
+    madvise (map, size, MADV_SEQUENTIAL);
+    futimens (fd, NULL);
+  }
+  else
+  {
+    fprintf (stderr, "Removing damaged cache entry %s\n", path);
+    unlink (path);
+  }
+
+  close (fd);
+  *map_size = size;
+  return map;
+}
+
+/* Saves the four forward directions (east, southwest, south and southeast)
+ * of each pixel's weights as the entry for key */
+static void
+cache_store_weights (const Options *options, const CacheKey *key, const Image *image,
+                     const Layout *layout, const char *g_array)
+{
+  size_t element_size = precision_size (options->precision);
+  char path [PATH_MAX], temp_path [PATH_MAX];
+  CacheHeader header;
+  char *row;
+  int x, y, fd, ok;
+
+  row = malloc ((size_t) image->width * 4 * element_size);
+  if (!row)
+    abort_ ("Could not allocate memory for the cache entry");
+
+  cache_header_init (&header, key, image);
+
+  fd = cache_entry_create (options, key, CACHE_WEIGHTS_SUFFIX, path, temp_path);
+  ok = fd >= 0 && write_fully (fd, &header, sizeof (header));
+
+  for (y = 0; ok && y < image->height; y++)
+  {
+    for (x = 0; x < image->width; x++)
+      memcpy (row + x * 4 * element_size, g_array + (layout_index (layout, x, y) * 8 + 4) * element_size,
+              4 * element_size);
+
+    ok = write_fully (fd, row, (size_t) image->width * 4 * element_size);
+  }
+
+  cache_entry_commit (options, fd, ok, path, temp_path);
+  free (row);
+}
+
+typedef struct
+{
+  const Image *image;
+  const Layout *layout;
+  const png_byte *stored;
+  char *g_array;
+  size_t element_size;
+}
+ExpandWeightsArgs;
+
+/* Direction i of a pixel is direction 7 - i of the neighbor it points to */
+static inline void
+expand_weights_rows (const ExpandWeightsArgs *args, int y0, int y1, size_t element_size)
+{
+  int width = args->image->width;
+  int x, y, i;
+
+  for (y = y0; y < y1; y++)
+  {
+    for (x = 0; x < width; x++)
+    {
+      size_t index = (size_t) y * width + x;
+      char *g = args->g_array + layout_index (args->layout, x, y) * 8 * element_size;
+
+      memcpy (g + 4 * element_size, args->stored + index * 4 * element_size, 4 * element_size);
+
+      for (i = 0; i < 4; i++)
+      {
+        int neighbor_x = x + nx8 [i], neighbor_y = y + ny8 [i];
+
+        if (neighbor_x < 0 || neighbor_x >= width || neighbor_y < 0)
+          memset (g + i * element_size, 0, element_size);
+        else
+          memcpy (g + i * element_size,
+                  args->stored + (((size_t) neighbor_y * width + neighbor_x) * 4 + 3 - i) * element_size,
+                  element_size);
+      }
+    }
+  }
+}
+
+static void
+expand_weights_worker (int worker, int n_workers, void *data)
+{
+  const ExpandWeightsArgs *args = data;
+  int y0, y1;
+
+  worker_rows (worker, n_workers, 0, args->image->height, &y0, &y1);
+
+  /* With the element size known, the copies compile to plain moves */
+  if (args->element_size == 4)
+    expand_weights_rows (args, y0, y1, 4);
+  else
+    expand_weights_rows (args, y0, y1, 2);
+}
+
+/* Checkpoints
+ * -----------
+ *
+ * With --checkpoint=FILE, the strengths and the iteration count are saved to
+ * FILE every --checkpoint-interval seconds while solving, and --resume picks
+ * the job up from there. The file is keyed like the cache, by the image, the
+ * seeds and the storage format, so it's only used for the job it was made
+ * for. It's removed once the job is done.
+ *
+ * The solver only stops to copy the strengths; a thread of its own writes
+ * and syncs the copy, and a checkpoint that comes due while the last one is
+ * still being written waits for the next iteration. The copy is made at the
+ * barrier between iterations, so every worker waits for it: on a large job
+ * that's a pause of about one pass over the strengths every interval. It is
+ * carved from the job arena, so memory limits and budgets count it. */
+
+typedef struct
+{
+  const char *path;
+  CacheKey key;
+  int width, height;
+  size_t element_size;
+  int interval;
+  double last_save;
+
+  /* Copy of the strengths being saved, in checkpoint_arena_size () bytes of
+   * the job arena, and the number of iterations they're the result of. Owned
+   * by the writer while pending is set. */
+  void *snapshot;
+  int snapshot_iterations;
+  int pending;
+  int quit;
+
+  /* Layout of the strengths being saved, if not rows; the file is always
+   * in rows */
+  const Layout *layout;
+
+#ifdef WITH_THREADS
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+#endif
+}
+Checkpoint;
+
+/* Header of a checkpoint, followed by the strengths */
+typedef struct
+{
+  CacheHeader header;
+  int32_t iterations;
+  int32_t padding;
+}
+CheckpointHeader;
+
+/* Without image_key, the checkpoint isn't keyed by the job's input (see
+ * checkpoint_on_preempt), and overlay only gives its size */
+static void
+checkpoint_init (Checkpoint *checkpoint, const CacheKey *image_key, const Image *overlay,
+                 const Options *options)
+{
+  int params [1];
+
+  /* Not a valid soft alpha radius, so it can't be mistaken for a result key */
+  params [0] = -1;
+
+  checkpoint->path = options->checkpoint_path;
+  memset (&checkpoint->key, 0, sizeof (checkpoint->key));
+  if (image_key)
+  {
+    checkpoint->key = *image_key;
+    cache_hash (&checkpoint->key, params, 1, overlay);
+  }
+  checkpoint->width = overlay->width;
+  checkpoint->height = overlay->height;
+  checkpoint->element_size = precision_size (options->precision);
+  checkpoint->interval = options->checkpoint_interval;
+  checkpoint->last_save = now ();
+  checkpoint->layout = NULL;
+}
+
+static void
+checkpoint_header_init (const Checkpoint *checkpoint, CheckpointHeader *header, int iterations)
+{
+  memset (header, 0, sizeof (CheckpointHeader));
+  header->header.key = checkpoint->key;
+  header->header.width = checkpoint->width;
+  header->header.height = checkpoint->height;
+  header->iterations = iterations;
+}
+
+static size_t
+checkpoint_size (const Checkpoint *checkpoint)
+{
+  return (size_t) checkpoint->width * checkpoint->height * checkpoint->element_size;
+}
+
+/* Arena space a job with options needs for checkpoints while solving */
+static size_t
+checkpoint_arena_size (int width, int height, const Options *options)
+{
+  if (!options->checkpoint_path || options->checkpoint_on_preempt)
+    return 0;
+
+  return arena_round ((size_t) width * height * precision_size (options->precision));
+}
+
+/* Saves strength, the result of the given number of iterations. It's written
+ * under a temporary name, synced and renamed, so a checkpoint on disk is
+ * always complete. */
+static void
+checkpoint_save (const Checkpoint *checkpoint, const void *strength, int iterations)
+{
+  char temp_path [PATH_MAX];
+  CheckpointHeader header;
+  int fd, ok;
+
+  if (snprintf (temp_path, sizeof (temp_path), "%s.tmp", checkpoint->path) >= (int) sizeof (temp_path))
+    abort_ ("Checkpoint file name too long: %s", checkpoint->path);
+
+  checkpoint_header_init (checkpoint, &header, iterations);
+
+  fd = open (temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+    abort_ ("Could not create checkpoint %s: %s", temp_path, strerror (errno));
+
+  ok = write_fully (fd, &header, sizeof (header))
+    && write_fully (fd, strength, checkpoint_size (checkpoint))
+    && fsync (fd) == 0;
+  ok = close (fd) == 0 && ok;
+
+  if (!ok || rename (temp_path, checkpoint->path) != 0)
+    abort_ ("Could not write checkpoint %s: %s", checkpoint->path, strerror (errno));
+}
+
+static int
+checkpoint_due (const Checkpoint *checkpoint)
+{
+  return now () - checkpoint->last_save >= checkpoint->interval;
+}
+
+/* Loads the saved strengths into strength and returns the number of
+ * iterations they're the result of, or -1 if there is no checkpoint for
+ * this job */
+static int
+checkpoint_load (const Checkpoint *checkpoint, void *strength)
+{
+  size_t size = checkpoint_size (checkpoint);
+  CheckpointHeader header, expected;
+  struct stat st;
+  int fd, ok;
+
+  fd = open (checkpoint->path, O_RDONLY);
+  if (fd < 0)
+  {
+    if (errno == ENOENT)
+      return -1;
+    abort_ ("Could not open checkpoint %s: %s", checkpoint->path, strerror (errno));
+  }
+
+  checkpoint_header_init (checkpoint, &expected, 0);
+
+  ok = fstat (fd, &st) == 0 && (size_t) st.st_size == sizeof (header) + size
+    && read_fully (fd, &header, sizeof (header));
+  expected.iterations = header.iterations;
+  ok = ok && !memcmp (&header, &expected, sizeof (header))
+    && header.iterations >= 0 && header.iterations < MAX_ITER;
+
+  if (!ok)
+  {
+    close (fd);
+    fprintf (stderr, "Checkpoint %s is for another job, starting over\n", checkpoint->path);
+    return -1;
+  }
+
+  if (!read_fully (fd, strength, size))
+    abort_ ("Could not read checkpoint %s", checkpoint->path);
+
+  close (fd);
+  return header.iterations;
+}
+
+/* Returns nonzero if a job that was stopped should save a checkpoint */
+static int
+checkpoint_on_cancel (const Options *options)
+{
+  return !options->checkpoint_on_preempt
+    || (options->cancel && cancel_reason (options->cancel) == CANCEL_PREEMPTED);
+}
+
+#ifdef WITH_THREADS
+
+static void *
+checkpoint_thread (Checkpoint *checkpoint)
+{
+  pthread_mutex_lock (&checkpoint->mutex);
+
+  for (;;)
+  {
+    while (!checkpoint->pending && !checkpoint->quit)
+      pthread_cond_wait (&checkpoint->cond, &checkpoint->mutex);
+
+    if (!checkpoint->pending)
+      break;
+
+    pthread_mutex_unlock (&checkpoint->mutex);
+    checkpoint_save (checkpoint, checkpoint->snapshot, checkpoint->snapshot_iterations);
+    pthread_mutex_lock (&checkpoint->mutex);
+
+    checkpoint->pending = 0;
+  }
+
+  pthread_mutex_unlock (&checkpoint->mutex);
+  return NULL;
+}
+
+#endif
+
+/* Starts the writer, before solving, with the copies made in snapshot */
+static void
+checkpoint_start (Checkpoint *checkpoint, void *snapshot)
+{
+  checkpoint->snapshot = snapshot;
+  checkpoint->pending = 0;
+  checkpoint->quit = 0;
+
+#ifdef WITH_THREADS
+  pthread_mutex_init (&checkpoint->mutex, NULL);
+  pthread_cond_init (&checkpoint->cond, NULL);
+  pthread_create (&checkpoint->thread, NULL, (void *(*)(void *)) checkpoint_thread, checkpoint);
+#endif
+}
+
+/* Hands a copy of strength, the result of the given number of iterations,
+ * to the writer, unless it's still busy with the last one */
+static void
+checkpoint_update (Checkpoint *checkpoint, const void *strength, int iterations)
+{
+#ifdef WITH_THREADS
+  int busy;
+
+  pthread_mutex_lock (&checkpoint->mutex);
+  busy = checkpoint->pending;
+  pthread_mutex_unlock (&checkpoint->mutex);
+
+  if (busy)
+    return;
+#endif
+
+  if (checkpoint->layout)
+    layout_copy_rows (checkpoint->layout, checkpoint->snapshot, strength, checkpoint->element_size, 0,
+                      0, checkpoint->height);
+  else
+    memcpy (checkpoint->snapshot, strength, checkpoint_size (checkpoint));
+  checkpoint->snapshot_iterations = iterations;
+  checkpoint->last_save = now ();
+
+#ifdef WITH_THREADS
+  pthread_mutex_lock (&checkpoint->mutex);
+  checkpoint->pending = 1;
+  pthread_cond_signal (&checkpoint->cond);
+  pthread_mutex_unlock (&checkpoint->mutex);
+#else
+  checkpoint_save (checkpoint, checkpoint->snapshot, iterations);
+#endif
+}
+
+/* Waits for the writer to finish the last save and stops it. Must be
+ * called before the file is written or removed by anyone else. */
+static void
+checkpoint_finish (Checkpoint *checkpoint)
+{
+#ifdef WITH_THREADS
+  pthread_mutex_lock (&checkpoint->mutex);
+  checkpoint->quit = 1;
+  pthread_cond_signal (&checkpoint->cond);
+  pthread_mutex_unlock (&checkpoint->mutex);
+
+  pthread_join (checkpoint->thread, NULL);
+  pthread_mutex_destroy (&checkpoint->mutex);
+  pthread_cond_destroy (&checkpoint->cond);
+#endif
+}
+
+/* Previews
+ * --------
+ *
+ * With --preview=FILE, a mask of the labels so far is written to FILE while
+ * solving: white for foreground, black for background and grey where no
+ * label has arrived yet. It's scaled down to PREVIEW_SIZE pixels on the
+ * longest side by taking one cell from each block, so sampling it holds up
+ * the solver for next to no time. A thread of its own encodes and writes
+ * it, and a preview that comes due while the last one is still being
+ * written is skipped. Each is written under a temporary name and renamed,
+ * so a reader never sees half a file. */
+
+typedef struct
+{
+  const char *path;
+  Precision precision;
+  int width, height;
+  int scale;
+
+  /* When the next one is due */
+  int interval;
+  int iteration_interval;
+  double last_time;
+  int last_iteration;
+
+  /* Layout of the strengths, if not rows */
+  const Layout *layout;
+
+  /* Owned by the writer while pending is set */
+  Image mask;
+  int pending;
+  int quit;
+
+#ifdef WITH_THREADS
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+#endif
+}
+Preview;
+
+static void
+preview_write (const Preview *preview)
+{
+  char temp_path [PATH_MAX];
+
+  if (snprintf (temp_path, sizeof (temp_path), "%s.tmp", preview->path) >= (int) sizeof (temp_path))
+    abort_ ("Preview file name too long: %s", preview->path);
+
+  write_png_file (&preview->mask, temp_path);
+
+  if (rename (temp_path, preview->path) != 0)
+    fprintf (stderr, "Could not write preview %s: %s\n", preview->path, strerror (errno));
+}
+
+/* Fills in the mask from the strengths */
+static void
+preview_sample (Preview *preview, const void *strength)
+{
+  int x, y;
+
+  for (y = 0; y < preview->mask.height; y++)
+  {
+    int sy = y * preview->scale + preview->scale / 2;
+
+    if (sy >= preview->height)
+      sy = preview->height - 1;
+
+    for (x = 0; x < preview->mask.width; x++)
+    {
+      int sx = x * preview->scale + preview->scale / 2;
+      ptrdiff_t index;
+      float s;
+
+      if (sx >= preview->width)
+        sx = preview->width - 1;
+      index = preview->layout ? layout_index (preview->layout, sx, sy) : (ptrdiff_t) sy * preview->width + sx;
+      s = load_float (preview->precision, strength, index);
+
+      preview->mask.rows [y] [x] = s > 0.0f ? 0xff : s < 0.0f ? 0x00 : 0x80;
+    }
+  }
+}
+
+#ifdef WITH_THREADS
+
+static void *
+preview_thread (Preview *preview)
+{
+  pthread_mutex_lock (&preview->mutex);
+
+  for (;;)
+  {
+    while (!preview->pending && !preview->quit)
+      pthread_cond_wait (&preview->cond, &preview->mutex);
+
+    if (!preview->pending)
+      break;
+
+    pthread_mutex_unlock (&preview->mutex);
+    preview_write (preview);
+    pthread_mutex_lock (&preview->mutex);
+
+    preview->pending = 0;
+  }
+
+  pthread_mutex_unlock (&preview->mutex);
+  return NULL;
+}
+
+#endif
+
+static void
+preview_start (Preview *preview, const Image *image, const Options *options)
+{
+  int longest = image->width > image->height ? image->width : image->height;
+  int y;
+
+  memset (preview, 0, sizeof (Preview));
+  preview->path = options->preview_path;
+  preview->precision = options->precision;
+  preview->width = image->width;
+  preview->height = image->height;
+  preview->scale = (longest + PREVIEW_SIZE - 1) / PREVIEW_SIZE;
+  preview->interval = options->preview_interval;
+  preview->iteration_interval = options->preview_iterations;
+  preview->last_time = now ();
+
+  preview->mask.width = (image->width + preview->scale - 1) / preview->scale;
+  preview->mask.height = (image->height + preview->scale - 1) / preview->scale;
+  preview->mask.color_type = PNG_COLOR_TYPE_GRAY;
+  preview->mask.bit_depth = 8;
+  preview->mask.rows = malloc (preview->mask.height * sizeof (png_bytep));
+  preview->mask.rows [0] = malloc ((size_t) preview->mask.width * preview->mask.height);
+  for (y = 1; y < preview->mask.height; y++)
+    preview->mask.rows [y] = preview->mask.rows [y - 1] + preview->mask.width;
+
+#ifdef WITH_THREADS
+  pthread_mutex_init (&preview->mutex, NULL);
+  pthread_cond_init (&preview->cond, NULL);
+  pthread_create (&preview->thread, NULL, (void *(*)(void *)) preview_thread, preview);
+#endif
+}
+
+static int
+preview_due (const Preview *preview, int iterations)
+{
+  if (preview->iteration_interval > 0)
+    return iterations - preview->last_iteration >= preview->iteration_interval;
+
+  return now () - preview->last_time >= preview->interval;
+}
+
+/* Hands a preview of strength, the result of the given number of
+ * iterations, to the writer, unless it's still busy with the last one */
+static void
+preview_update (Preview *preview, const void *strength, int iterations)
+{
+#ifdef WITH_THREADS
+  int busy;
+
+  pthread_mutex_lock (&preview->mutex);
+  busy = preview->pending;
+  pthread_mutex_unlock (&preview->mutex);
+
+  if (busy)
+    return;
+#endif
+
+  preview_sample (preview, strength);
+  preview->last_time = now ();
+  preview->last_iteration = iterations;
+
+#ifdef WITH_THREADS
+  pthread_mutex_lock (&preview->mutex);
+  preview->pending = 1;
+  pthread_cond_signal (&preview->cond);
+  pthread_mutex_unlock (&preview->mutex);
+#else
+  preview_write (preview);
+#endif
+}
+
+/* Waits for the writer, then writes a last preview from the final
+ * strengths, unless strength is NULL */
+static void
+preview_finish (Preview *preview, const void *strength)
+{
+#ifdef WITH_THREADS
+  pthread_mutex_lock (&preview->mutex);
+  preview->quit = 1;
+  pthread_cond_signal (&preview->cond);
+  pthread_mutex_unlock (&preview->mutex);
+
+  pthread_join (preview->thread, NULL);
+  pthread_mutex_destroy (&preview->mutex);
+  pthread_cond_destroy (&preview->cond);
+#endif
+
+  if (strength)
+  {
+    preview_sample (preview, strength);
+    preview_write (preview);
+  }
+
+  free (preview->mask.rows [0]);
+  free (preview->mask.rows);
+}
+
+/* What to do with the strengths between iterations. Either may be NULL. */
+typedef struct
+{
+  Checkpoint *checkpoint;
+  Preview *preview;
+}
+Progress;
+
+static int
+progress_due (const Progress *progress, int iterations)
+{
+  return (progress->checkpoint && checkpoint_due (progress->checkpoint))
+    || (progress->preview && preview_due (progress->preview, iterations));
+}
+
+/* Hands the strengths to the checkpoint and preview writers if they're due.
+ * For IterationArgs.progress, so it runs while the workers wait; nothing
+ * here touches the disk. */
+static void
+progress_iteration (void *data, const void *strength, int iterations)
+{
+  Progress *progress = data;
+
+  if (progress->checkpoint && checkpoint_due (progress->checkpoint))
+    checkpoint_update (progress->checkpoint, strength, iterations);
+  if (progress->preview && preview_due (progress->preview, iterations))
+    preview_update (progress->preview, strength, iterations);
+}
+
+/* Out-of-core solver
+ * ------------------
+ *
+ * The weights and both strength buffers live in an unlinked scratch file and
+ * are paged through memory one tile at a time, a tile being a band of full
+ * rows. Each tile reads a halo row above and below from the previous
+ * iteration's buffer, so tiles see each other's results exactly as they would
+ * in memory, and the output is identical.
+ *
+ * A tile is only paged in if it or one of its neighbors changed in the
+ * previous iteration; elsewhere both buffers already hold the same values.
+ * This keeps the I/O proportional to the active front.
+ *
+ * The decoded image is not paged. It stays in memory to receive the alpha,
+ * so memory use still grows with the image, at 4 bytes a pixel instead of
+ * the 40 of the solver arrays in fp32. */
+
+typedef struct
+{
+  int fd;
+  int width, height;
+  int tile_rows;
+  size_t element_size;
+  off_t g_offset;
+  off_t strength_offset [2];
+}
+ScratchFile;
+
+static off_t
+page_align (off_t offset)
+{
+  off_t page_size = sysconf (_SC_PAGESIZE);
+
+  return (offset + page_size - 1) / page_size * page_size;
+}
+
+static int
+out_of_core_tile_rows (int width, const Options *options)
+{
+  /* Weights, input and output strengths, plus a halo row on either side */
+  size_t tile_row_size = (size_t) width * 10 * precision_size (options->precision);
+  size_t tile_rows = options->tile_bytes / tile_row_size;
+
+  return tile_rows < 3 ? 1 : tile_rows - 2;
+}
+
+static void
+scratch_open (ScratchFile *scratch, const Image *image, const Options *options)
+{
+  off_t strength_size;
+
+  scratch->fd = create_scratch_fd (options->scratch_dir);
+  scratch->width = image->width;
+  scratch->height = image->height;
+  scratch->tile_rows = out_of_core_tile_rows (image->width, options);
+  scratch->element_size = precision_size (options->precision);
+
+  /* Strength buffers are page aligned so the result can be mapped */
+  strength_size = (off_t) image->width * image->height * scratch->element_size;
+  scratch->g_offset = 0;
+  scratch->strength_offset [0] = page_align (scratch->g_offset + strength_size * 8);
+  scratch->strength_offset [1] = page_align (scratch->strength_offset [0] + strength_size);
+
+  /* The file is sparse, so the second strength buffer starts out as zeros */
+  if (ftruncate (scratch->fd, scratch->strength_offset [1] + strength_size) < 0)
+    abort_ ("Could not size scratch file: %s", strerror (errno));
+}
+
+static void
+scratch_io (const ScratchFile *scratch, int writing, off_t offset, void *buf, size_t size)
+{
+  char *p = buf;
+
+  while (size > 0)
+  {
+    ssize_t n = writing ? pwrite (scratch->fd, p, size, offset) : pread (scratch->fd, p, size, offset);
+
+    if (n <= 0)
+      abort_ ("Scratch file %s failed: %s", writing ? "write" : "read",
+              n < 0 ? strerror (errno) : "unexpected end of file");
+
+    p += n;
+    offset += n;
+    size -= n;
+  }
+}
+
+static off_t
+scratch_g_offset (const ScratchFile *scratch, int y)
+{
+  return scratch->g_offset + (off_t) y * scratch->width * 8 * scratch->element_size;
+}
+
+static off_t
+scratch_strength_offset (const ScratchFile *scratch, int buffer, int y)
+{
+  return scratch->strength_offset [buffer] + (off_t) y * scratch->width * scratch->element_size;
+}
+
+/* Streams the image through the preprocessing steps a row at a time, keeping
+ * only three rows of colour data at each stage, and writes out weights and
+ * seeds a tile at a time. */
+static size_t
+preprocess_out_of_core_arena_size (int width, int tile_rows, Precision precision)
+{
+  return arena_round (colour_row_size (width) * sizeof (float)) * 6
+    + arena_round ((size_t) width * 8 * sizeof (float))
+    + arena_round ((size_t) tile_rows * width * 8 * precision_size (precision))
+    + arena_round ((size_t) tile_rows * width * precision_size (precision));
+}
+
+static void
+preprocess_out_of_core (Arena *arena, const Image *image, const Image *overlay,
+                        const ScratchFile *scratch, Precision precision, CancelToken *cancel)
+{
+  int width = image->width;
+  int height = image->height;
+  int tile_rows = scratch->tile_rows;
+  size_t element_size = scratch->element_size;
+  float *raw [3], *blurred [3];
+  float *g_row;
+  char *g_tile, *seed_tile;
+  int y, i;
+
+  for (i = 0; i < 3; i++)
+  {
+    raw [i] = arena_alloc (arena, colour_row_size (width) * sizeof (float));
+    blurred [i] = arena_alloc (arena, colour_row_size (width) * sizeof (float));
+  }
+
+  /* Weights are computed in float and packed into the tiles */
+  g_row = arena_alloc (arena, (size_t) width * 8 * sizeof (float));
+  g_tile = arena_alloc (arena, (size_t) tile_rows * width * 8 * element_size);
+  seed_tile = arena_alloc (arena, (size_t) tile_rows * width * element_size);
+
+  for (y = 0; y < height + 2; y++)
+  {
+    int by = y - 1;
+    int gy = y - 2;
+
+    if (y < height)
+      kernels->image_row_to_array (image, y, raw [y % 3]);
+
+    if (by >= 0 && by < height)
+      kernels->blur_row (width,
+                         by > 0 ? raw [(by - 1) % 3] : NULL,
+                         raw [by % 3],
+                         by < height - 1 ? raw [(by + 1) % 3] : NULL,
+                         blurred [by % 3]);
+
+    if (gy >= 0)
+    {
+      int tile_y = gy % tile_rows;
+
+      kernels->calc_g_row (width,
+                           gy > 0 ? blurred [(gy - 1) % 3] : NULL,
+                           blurred [gy % 3],
+                           gy < height - 1 ? blurred [(gy + 1) % 3] : NULL,
+                           g_row);
+      kernels->overlay_row_to_seeds [precision] (overlay->rows [gy],
+                                                 seed_tile + (size_t) tile_y * width * element_size,
+                                                 width);
+
+      pack_floats (precision, g_tile + (size_t) tile_y * width * 8 * element_size, g_row,
+                   (size_t) width * 8);
+
+      if (tile_y == tile_rows - 1 || gy == height - 1)
+      {
+        int y0 = gy - tile_y;
+
+        scratch_io (scratch, 1, scratch_g_offset (scratch, y0), g_tile,
+                    (size_t) (tile_y + 1) * width * 8 * element_size);
+        scratch_io (scratch, 1, scratch_strength_offset (scratch, 0, y0), seed_tile,
+                    (size_t) (tile_y + 1) * width * element_size);
+
+        /* The caller sees the cancellation too, and gives up on the job */
+        if (job_cancelled (cancel))
+          return;
+      }
+    }
+  }
+}
+
+/* Asks the kernel to start reading the next active tile while we work */
+static void
+prefetch_next_tile (const ScratchFile *scratch, const unsigned char *active, int n_tiles,
+                    int t, int in_buffer)
+{
+  int y0, y1;
+
+  for (t++; t < n_tiles && !active [t]; t++)
+    ;
+
+  if (t == n_tiles)
+    return;
+
+  y0 = t * scratch->tile_rows;
+  y1 = y0 + scratch->tile_rows < scratch->height ? y0 + scratch->tile_rows : scratch->height;
+
+  posix_fadvise (scratch->fd, scratch_g_offset (scratch, y0),
+                 scratch_g_offset (scratch, y1) - scratch_g_offset (scratch, y0),
+                 POSIX_FADV_WILLNEED);
+  posix_fadvise (scratch->fd, scratch_strength_offset (scratch, in_buffer, y0 > 0 ? y0 - 1 : y0),
+                 (off_t) (y1 - y0 + 2) * scratch->width * scratch->element_size,
+                 POSIX_FADV_WILLNEED);
+}
+
+static size_t
+solve_out_of_core_arena_size (int width, int height, int tile_rows, Precision precision)
+{
+  size_t tile_size = (size_t) (tile_rows + 2) * width * precision_size (precision);
+  int n_tiles = (height + tile_rows - 1) / tile_rows;
+
+  return arena_round (tile_size) * 2
+    + arena_round (tile_size * 8)
+    + arena_round (n_tiles) * 2;
+}
+
+/* Maps strength buffer i of the scratch file */
+static void *
+scratch_map_strength (const ScratchFile *scratch, int i, int prot)
+{
+  void *strength;
+
+  strength = mmap (NULL, (size_t) scratch->width * scratch->height * scratch->element_size, prot,
+                   MAP_SHARED, scratch->fd, scratch->strength_offset [i]);
+  if (strength == MAP_FAILED)
+    abort_ ("Could not map scratch file: %s", strerror (errno));
+
+  return strength;
+}
+
+/* Iterates from buffer 0, which holds the result of *iterations iterations
+ * (0 unless resuming), reporting to progress if it's given. Returns the index
+ * of the strength buffer holding the result, and the number of iterations it
+ * is the result of in *iterations. If the job is cancelled, *cancelled is
+ * set, and the buffer returned holds what's been done so far. */
+static int
+solve_out_of_core (WorkerPool *pool, Arena *arena, const Image *image, const ScratchFile *scratch,
+                   const Options *options, Progress *progress, int *iterations, int *cancelled)
+{
+  int width = image->width;
+  int height = image->height;
+  int tile_rows = scratch->tile_rows;
+  int n_tiles = (height + tile_rows - 1) / tile_rows;
+  size_t element_size = scratch->element_size;
+  size_t tile_size = (size_t) (tile_rows + 2) * width * element_size;
+  char *overlay_array_in, *overlay_array_out, *g_array;
+  unsigned char *active, *changed;
+  IterationArgs args;
+  int in_buffer = 0;
+  int iter = *iterations;
+  int t;
+
+  /* Tile buffers start at the halo row above the tile */
+  overlay_array_in = arena_alloc (arena, tile_size);
+  overlay_array_out = arena_alloc (arena, tile_size);
+  g_array = arena_alloc (arena, tile_size * 8);
+
+  iteration_args_init (&args, image, options, pool, arena);
+  args.overlay_array_in = overlay_array_in;
+  args.overlay_array_out = overlay_array_out;
+  args.g_array = g_array;
+
+  active = arena_alloc (arena, n_tiles);
+  changed = arena_alloc (arena, n_tiles);
+  memset (active, 1, n_tiles);
+
+  for (;;)
+  {
+    int converged = 1;
+
+    for (t = 0; t < n_tiles; t++)
+    {
+      int y0 = t * tile_rows;
+      int y1 = y0 + tile_rows < height ? y0 + tile_rows : height;
+      int halo_y0 = y0 > 0 ? y0 - 1 : y0;
+      int halo_y1 = y1 < height ? y1 + 1 : y1;
+
+      changed [t] = 0;
+
+      if (!active [t])
+        continue;
+
+      if (job_cancelled (options->cancel))
+        break;
+
+      prefetch_next_tile (scratch, active, n_tiles, t, in_buffer);
+
+      scratch_io (scratch, 0, scratch_strength_offset (scratch, in_buffer, halo_y0),
+                  overlay_array_in + (size_t) (halo_y0 - (y0 - 1)) * width * element_size,
+                  (size_t) (halo_y1 - halo_y0) * width * element_size);
+      scratch_io (scratch, 0, scratch_g_offset (scratch, y0),
+                  g_array + (size_t) width * 8 * element_size,
+                  (size_t) (y1 - y0) * width * 8 * element_size);
+
+      args.y0 = y0;
+      args.y1 = y1;
+      args.row_base = y0 - 1;
+
+      if (!process_iteration (pool, &args))
+      {
+        changed [t] = 1;
+        converged = 0;
+      }
+
+      scratch_io (scratch, 1, scratch_strength_offset (scratch, 1 - in_buffer, y0),
+                  overlay_array_out + (size_t) width * element_size,
+                  (size_t) (y1 - y0) * width * element_size);
+    }
+
+    /* Cancelled; buffer in_buffer still holds the result of iter iterations */
+    if (t < n_tiles)
+    {
+      *iterations = iter;
+      *cancelled = 1;
+      return in_buffer;
+    }
+
+    if (converged || ++iter >= MAX_ITER)
+      break;
+
+    for (t = 0; t < n_tiles; t++)
+      active [t] = changed [t] | (t > 0 && changed [t - 1]) | (t < n_tiles - 1 && changed [t + 1]);
+
+    in_buffer = 1 - in_buffer;
+
+    if (progress && progress_due (progress, iter))
+    {
+      void *strength = scratch_map_strength (scratch, in_buffer, PROT_READ);
+
+      progress_iteration (progress, strength, iter);
+      munmap (strength, (size_t) width * height * element_size);
+    }
+  }
+
+  *iterations = iter + 1;
+  return 1 - in_buffer;
+}
+
+/* Preprocessing, solving and alpha generation run one after the other, so
+ * they take turns at the same stretch of the arena. The decoded overlay is
+ * only needed while preprocessing. */
+static size_t
+out_of_core_arena_size (int width, int height, const Options *options, int n_workers)
+{
+  int tile_rows = out_of_core_tile_rows (width, options);
+  size_t pre_size = image_arena_size (width, height)
+    + preprocess_out_of_core_arena_size (width, tile_rows, options->precision);
+  size_t solve_size = solve_out_of_core_arena_size (width, height, tile_rows, options->precision)
+    + iteration_arena_size (n_workers) + checkpoint_arena_size (width, height, options);
+  size_t alpha_size = alpha_arena_size (width, height, options->soft_alpha_radius, n_workers);
+  size_t size = pre_size > solve_size ? pre_size : solve_size;
+
+  return size > alpha_size ? size : alpha_size;
+}
+
+/* Like process_file () */
+static int
+process_file_out_of_core (WorkerPool *pool, Arena *arena, Image *image,
+                          PngReader *overlay_reader, Image *overlay, const Options *options,
+                          JobStats *stats)
+{
+  int use_cache = options->cache_dir && !stats;
+  int use_checkpoint = options->checkpoint_path && !stats;
+  int save_progress = use_checkpoint && !options->checkpoint_on_preempt;
+  int use_preview = options->preview_path && !stats;
+  ScratchFile scratch;
+  size_t strength_size;
+  CacheKey image_key, key;
+  Checkpoint checkpoint;
+  Preview preview;
+  Progress progress;
+  size_t mark;
+  void *strength;
+  int iterations = 0;
+  int cancelled = 0;
+  int result;
+
+  mark = arena->used;
+  png_reader_read (overlay_reader, overlay, image_rows_alloc (overlay, arena));
+
+  if (use_cache || save_progress)
+  {
+    cache_image_key (&image_key, image, options);
+    cache_result_key (&key, &image_key, overlay, options);
+    if (use_cache && cache_fetch_alpha (options, &key, image))
+      return 1;
+  }
+
+  if (use_checkpoint)
+    checkpoint_init (&checkpoint, save_progress ? &image_key : NULL, overlay, options);
+
+  scratch_open (&scratch, image, options);
+  preprocess_out_of_core (arena, image, overlay, &scratch, options->precision, options->cancel);
+  arena_release (arena, (char *) arena->buffer.data + mark, arena->used - mark);
+  arena->used = mark;
+  overlay->rows = NULL;
+
+  if (job_cancelled (options->cancel))
+  {
+    close (scratch.fd);
+    return 0;
+  }
+
+  strength_size = (size_t) image->width * image->height * scratch.element_size;
+
+  if (use_checkpoint && options->resume)
+  {
+    strength = scratch_map_strength (&scratch, 0, PROT_READ | PROT_WRITE);
+    iterations = checkpoint_load (&checkpoint, strength);
+    iterations = iterations < 0 ? 0 : iterations;
+    munmap (strength, strength_size);
+  }
+
+  progress.checkpoint = save_progress ? &checkpoint : NULL;
+  progress.preview = use_preview ? &preview : NULL;
+  if (save_progress)
+    checkpoint_start (&checkpoint, arena_alloc (arena, checkpoint_arena_size (image->width, image->height,
+                                                                              options)));
+  if (use_preview)
+    preview_start (&preview, image, options);
+
+  result = solve_out_of_core (pool, arena, image, &scratch, options,
+                              save_progress || use_preview ? &progress : NULL, &iterations,
+                              &cancelled);
+  arena->used = mark;
+
+  /* Let the kernel page the result in as alpha generation streams over it */
+  strength = scratch_map_strength (&scratch, result, PROT_READ);
+
+  if (save_progress)
+    checkpoint_finish (&checkpoint);
+  if (use_preview)
+    preview_finish (&preview, cancelled ? NULL : strength);
+
+  if (cancelled)
+  {
+    if (use_checkpoint && checkpoint_on_cancel (options))
+      checkpoint_save (&checkpoint, strength, iterations);
+    munmap (strength, strength_size);
+    close (scratch.fd);
+    return 0;
+  }
+
+  if (stats)
+  {
+    stats->iterations = iterations;
+    if (stats->strength)
+      unpack_floats (options->precision, stats->strength, strength,
+                     (size_t) image->width * image->height);
+  }
+
+  generate_alpha (pool, arena, image, strength, options->precision, options->soft_alpha_radius);
+
+  munmap (strength, strength_size);
+  close (scratch.fd);
+
+  if (use_cache)
+    cache_store_alpha (options, &key, image);
+  if (use_checkpoint)
+    unlink (checkpoint.path);
+
+  return 1;
+}
+
+/* In-memory preprocessing. Every stage runs on the worker pool with the same
+ * row split as the solver, so each worker first touches the rows it owns. */
+
+typedef struct
+{
+  const Image *image;
+  const Image *overlay;
+  Precision precision;
+  float *image_array;
+  float *blurred_array;
+  char *overlay_array_a;
+  char *overlay_array_b;
+  char *g_array;
+
+  /* Layout of the weights; the other arrays are in rows */
+  const Layout *layout;
+
+  /* Per-worker float rows for formats other than float or weights in
+   * blocks, row_scratch_size () bytes each */
+  char *row_scratch;
+}
+PreprocessArgs;
+
+static size_t
+row_scratch_size (int width)
+{
+  return arena_round ((size_t) width * 8 * sizeof (float));
+}
+
+/* Where a worker should compute a row that ends up at dst */
+static float *
+float_row (const PreprocessArgs *args, int worker, void *dst)
+{
+  if (args->precision == PRECISION_FP32 && !args->layout->blocks)
+    return dst;
+
+  return (float *) (args->row_scratch + worker * row_scratch_size (args->image->width));
+}
+
+static void
+init_arrays_worker (int worker, int n_workers, void *data)
+{
+  const PreprocessArgs *args = data;
+  int width = args->image->width;
+  size_t element_size = precision_size (args->precision);
+  int y0, y1, y;
+
+  worker_rows (worker, n_workers, 0, args->image->height, &y0, &y1);
+
+  for (y = y0; y < y1; y++)
+  {
+    if (args->image_array)
+      kernels->image_row_to_array (args->image, y, args->image_array + (size_t) y * colour_row_size (width));
+    if (!args->overlay)
+      continue;
+    kernels->overlay_row_to_seeds [args->precision] (args->overlay->rows [y],
+                                                     args->overlay_array_a + (size_t) y * width * element_size,
+                                                     width);
+    memset (args->overlay_array_b + (size_t) y * width * element_size, 0, width * element_size);
+  }
+}
+
+static void
+blur_worker (int worker, int n_workers, void *data)
+{
+  const PreprocessArgs *args = data;
+  int height = args->image->height;
+  size_t row_size = colour_row_size (args->image->width);
+  const float *array = args->image_array;
+  int y0, y1, y;
+
+  worker_rows (worker, n_workers, 0, height, &y0, &y1);
+
+  for (y = y0; y < y1; y++)
+  {
+    kernels->blur_row (args->image->width,
+                       y > 0 ? array + (size_t) (y - 1) * row_size : NULL,
+                       array + (size_t) y * row_size,
+                       y < height - 1 ? array + (size_t) (y + 1) * row_size : NULL,
+                       args->blurred_array + (size_t) y * row_size);
+  }
+}
+
+static void
+calc_g_worker (int worker, int n_workers, void *data)
+{
+  const PreprocessArgs *args = data;
+  int height = args->image->height;
+  size_t row_size = colour_row_size (args->image->width);
+  size_t element_size = precision_size (args->precision);
+  const float *array = args->blurred_array;
+  int y0, y1, y;
+
+  worker_rows (worker, n_workers, 0, height, &y0, &y1);
+
+  for (y = y0; y < y1; y++)
+  {
+    char *g_row = args->g_array + layout_index (args->layout, 0, y) * 8 * element_size;
+    float *row = float_row (args, worker, g_row);
+    int x, n;
+
+    kernels->calc_g_row (args->image->width,
+                         y > 0 ? array + (size_t) (y - 1) * row_size : NULL,
+                         array + (size_t) y * row_size,
+                         y < height - 1 ? array + (size_t) (y + 1) * row_size : NULL,
+                         row);
+    if ((char *) row == g_row)
+      continue;
+
+    for (x = 0; x < args->image->width; x += n)
+    {
+      n = layout_run (args->layout, x);
+      pack_floats (args->precision, args->g_array + layout_index (args->layout, x, y) * 8 * element_size,
+                   row + x * 8, (size_t) n * 8);
+    }
+  }
+}
+
+typedef struct
+{
+  const Layout *layout;
+  char *dst;
+  const char *src;
+  size_t element_size;
+  int to_layout;
+}
+LayoutCopyArgs;
+
+static void
+layout_copy_worker (int worker, int n_workers, void *data)
+{
+  const LayoutCopyArgs *args = data;
+  int y0, y1;
+
+  worker_rows (worker, n_workers, 0, args->layout->height, &y0, &y1);
+  layout_copy_rows (args->layout, args->dst, args->src, args->element_size, args->to_layout, y0, y1);
+}
+
+/* Before solving, copies the seeds in overlay_array_in from rows into
+ * layout, and after, with to_layout zero, the result in overlay_array_out
+ * back into rows. Either way, the copy takes the place of the original. */
+static void
+layout_copy_strengths (WorkerPool *pool, const Layout *layout, IterationArgs *args, size_t element_size,
+                       int to_layout)
+{
+  LayoutCopyArgs copy;
+  const void *tmp_array;
+
+  copy.layout = layout;
+  copy.dst = to_layout ? args->overlay_array_out : (void *) args->overlay_array_in;
+  copy.src = to_layout ? args->overlay_array_in : args->overlay_array_out;
+  copy.element_size = element_size;
+  copy.to_layout = to_layout;
+  pool_run (pool, layout_copy_worker, &copy);
+
+  tmp_array = args->overlay_array_in;
+  args->overlay_array_in = args->overlay_array_out;
+  args->overlay_array_out = (void *) tmp_array;
+}
+
+/* In memory, the colour array and the decoded overlay are only needed until
+ * the seeds and weights have been computed, so they're kept in the space that
+ * becomes the weights. The blurred colours are dead once the weights are
+ * done; their pages are released before iterating and the space is reused
+ * for checkpoints while solving, then for alpha generation.
+ *
+ * The overlay is decoded by the main thread, and the colour rows are 12
+ * bytes a pixel against the weights' 16 or 32, so the pages of the weights
+ * are first touched by the wrong workers. With --numa, they're released
+ * once the colours and the overlay are dead, and each worker touches its
+ * own rows of weights afresh, on its own node. */
+
+static size_t
+colour_arena_size (int width, int height)
+{
+  return arena_round ((size_t) height * colour_row_size (width) * sizeof (float));
+}
+
+static size_t
+weights_arena_size (int width, int height, Precision precision)
+{
+  size_t n_pixels = (size_t) width * height;
+  size_t g_size = arena_round (n_pixels * 8 * precision_size (precision));
+  size_t pre_size = colour_arena_size (width, height) + image_arena_size (width, height);
+
+  return g_size > pre_size ? g_size : pre_size;
+}
+
+/* With --numa, drops the pages of the weights once the colours and the
+ * overlay are dead, so calc_g_worker () touches them afresh */
+static void
+release_weights_for_numa (Arena *arena, char *weights, const Image *image, const Options *options)
+{
+  if (options->numa)
+    arena_release (arena, weights, weights_arena_size (image->width, image->height, options->precision));
+}
+
+/* Arena space for everything process_file () needs besides the decoded image */
+static size_t
+process_arena_size (int width, int height, const Options *options, int n_workers)
+{
+  size_t n_pixels = (size_t) width * height;
+  size_t element_size = precision_size (options->precision);
+  size_t temp_size = colour_arena_size (width, height);
+  size_t alpha_size = alpha_arena_size (width, height, options->soft_alpha_radius, n_workers);
+  size_t snapshot_size = checkpoint_arena_size (width, height, options);
+
+  if (options->out_of_core)
+    return out_of_core_arena_size (width, height, options, n_workers);
+
+  if (options->precision != PRECISION_FP32 || options->block_size)
+    temp_size += n_workers * row_scratch_size (width);
+  if (temp_size < snapshot_size)
+    temp_size = snapshot_size;
+
+  return weights_arena_size (width, height, options->precision)
+    + arena_round (n_pixels * element_size) * 2
+    + layout_arena_size (width, height, options->block_size)
+    + iteration_arena_size (n_workers)
+    + (temp_size > alpha_size ? temp_size : alpha_size);
+}
+
+/* Processes image with the seeds from overlay, leaving the result in its
+ * alpha. Returns zero if the job was cancelled, leaving image as it was. */
+static int
+process_file (WorkerPool *pool, Arena *arena, Image *image, PngReader *overlay_reader,
+              Image *overlay, const Options *options, JobStats *stats)
+{
+  size_t n_pixels = (size_t) image->width * image->height;
+  size_t element_size = precision_size (options->precision);
+  int use_cache = options->cache_dir && !stats;
+  int use_checkpoint = options->checkpoint_path && !stats;
+  int save_progress = use_checkpoint && !options->checkpoint_on_preempt;
+  int use_preview = options->preview_path && !stats;
+  png_byte *stored_weights = NULL;
+  size_t stored_size = 0;
+  CacheKey image_key, key;
+  Checkpoint checkpoint;
+  Preview preview;
+  Progress progress;
+  PreprocessArgs pre;
+  IterationArgs args;
+  Layout layout;
+  char *weights;
+  size_t mark;
+  int iterations;
+  int cancelled;
+
+  if (options->out_of_core)
+    return process_file_out_of_core (pool, arena, image, overlay_reader, overlay, options, stats);
+
+  weights = arena_alloc (arena, weights_arena_size (image->width, image->height, options->precision));
+
+  png_reader_read (overlay_reader, overlay,
+                   image_rows_at (overlay, weights + colour_arena_size (image->width, image->height)));
+
+  /* Results of earlier jobs with the same input are reused as they are, and
+   * weights of earlier jobs with the same image */
+  if (options->cache_dir || save_progress)
+  {
+    cache_image_key (&image_key, image, options);
+    cache_result_key (&key, &image_key, overlay, options);
+
+    if (use_cache && cache_fetch_alpha (options, &key, image))
+    {
+      overlay->rows = NULL;
+      return 1;
+    }
+  }
+
+  if (options->cache_dir)
+    stored_weights = cache_map_weights (options, &image_key, image, &stored_size);
+
+  if (use_checkpoint)
+    checkpoint_init (&checkpoint, save_progress ? &image_key : NULL, overlay, options);
+
+  pre.image = image;
+  pre.overlay = overlay;
+  pre.precision = options->precision;
+  pre.image_array = stored_weights ? NULL : (float *) weights;
+  pre.g_array = weights;
+  pre.overlay_array_a = arena_alloc (arena, n_pixels * element_size);
+  pre.overlay_array_b = arena_alloc (arena, n_pixels * element_size);
+
+  layout_init (&layout, image->width, image->height, options->block_size, arena);
+  pre.layout = &layout;
+  iteration_args_init (&args, image, options, pool, arena);
+  if (layout.blocks)
+    args.layout = &layout;
+
+  mark = arena->used;
+  pre.blurred_array = arena_alloc (arena, colour_arena_size (image->width, image->height));
+  pre.row_scratch = NULL;
+  if (options->precision != PRECISION_FP32 || layout.blocks)
+    pre.row_scratch = arena_alloc (arena, pool->n_workers * row_scratch_size (image->width));
+
+  /* Init arrays, checking for cancellation between the passes */
+
+  pool_run (pool, init_arrays_worker, &pre);
+  cancelled = job_cancelled (options->cancel);
+  if (!cancelled && !stored_weights)
+  {
+    pool_run (pool, blur_worker, &pre);
+    cancelled = job_cancelled (options->cancel);
+  }
+  release_weights_for_numa (arena, weights, image, options);
+
+  if (stored_weights)
+  {
+    ExpandWeightsArgs expand;
+
+    /* The seeds have been read, so the overlay can be overwritten */
+    expand.image = image;
+    expand.layout = &layout;
+    expand.stored = stored_weights + sizeof (CacheHeader);
+    expand.g_array = weights;
+    expand.element_size = element_size;
+    if (!cancelled)
+      pool_run (pool, expand_weights_worker, &expand);
+    munmap (stored_weights, stored_size);
+  }
+  else if (!cancelled)
+  {
+    pool_run (pool, calc_g_worker, &pre);
+
+    if (options->cache_dir)
+      cache_store_weights (options, &image_key, image, &layout, weights);
+  }
+
+#ifdef SHOW_EFFECTS
+  for (y = 0; y < image->height; y++)
+  {
+    for (x = 0; x < image->width; x++)
+    {
+      png_byte image_pixel [4];
+
+      const float *colour = pre.blurred_array + (size_t) y * colour_row_size (image->width) + x;
+      int stride = colour_plane_width (image->width);
+
+      get_pixel (image, x, y, image_pixel);
+      image_pixel [0] = colour [0] * 255.0;
+      image_pixel [1] = colour [stride] * 255.0;
+      image_pixel [2] = colour [2 * stride] * 255.0;
+      set_pixel (image, x, y, image_pixel);
+    }
+  }
+#endif
+
+  /* Only the image, the weights and the strengths are live from here on */
+
+  arena_release (arena, (char *) pre.blurred_array, arena->used - mark);
+  arena->used = mark;
+  overlay->rows = NULL;
+
+  if (cancelled || job_cancelled (options->cancel))
+    return 0;
+
+  /* Process */
+
+  args.overlay_array_in = pre.overlay_array_a;
+  args.overlay_array_out = pre.overlay_array_b;
+  args.g_array = pre.g_array;
+
+  if (use_checkpoint && options->resume)
+  {
+    iterations = checkpoint_load (&checkpoint, pre.overlay_array_a);
+    args.iterations = iterations < 0 ? 0 : iterations;
+  }
+
+  /* The seeds and checkpoints are in rows */
+  if (args.layout)
+    layout_copy_strengths (pool, &layout, &args, element_size, 1);
+
+  progress.checkpoint = save_progress ? &checkpoint : NULL;
+  progress.preview = use_preview ? &preview : NULL;
+  /* The copy checkpoints are made from goes where the blurred colours were */
+  if (save_progress)
+  {
+    checkpoint.layout = args.layout;
+    checkpoint_start (&checkpoint, arena_alloc (arena, checkpoint_arena_size (image->width, image->height,
+                                                                              options)));
+  }
+  if (use_preview)
+  {
+    preview_start (&preview, image, options);
+    preview.layout = args.layout;
+  }
+
+  if (save_progress || use_preview)
+  {
+    args.progress = progress_iteration;
+    args.progress_data = &progress;
+  }
+
+  iterations = solve_in_memory (pool, &args);
+
+  if (save_progress)
+  {
+    checkpoint_finish (&checkpoint);
+    arena->used = mark;
+  }
+  if (use_preview)
+    preview_finish (&preview, args.cancelled ? NULL : args.overlay_array_out);
+
+  /* Everything from here on reads the strengths in rows */
+  if (args.layout)
+    layout_copy_strengths (pool, &layout, &args, element_size, 0);
+
+  if (args.cancelled)
+  {
+    if (use_checkpoint && checkpoint_on_cancel (options))
+      checkpoint_save (&checkpoint, args.overlay_array_out, args.iterations);
+    return 0;
+  }
+
+  if (stats)
+  {
+    stats->iterations = iterations;
+    if (stats->strength)
+      unpack_floats (options->precision, stats->strength, args.overlay_array_out, n_pixels);
+  }
+
+  /* Generate alpha from arrays */
+
+  generate_alpha (pool, arena, image, args.overlay_array_out, options->precision,
+                  options->soft_alpha_radius);
+
+  if (use_cache)
+    cache_store_alpha (options, &key, image);
+  if (use_checkpoint)
+    unlink (checkpoint.path);
+
+  return 1;
+}
+
+/* Several seed sets against one image
+ * ------------------------------------
+ *
+ * Overlays for the same image share the weights, so they're solved together:
+ * the strengths of all the sets are interleaved, and one pass over the
+ * weights updates every set. Iterating stops when no set changes; a set
+ * that converged earlier stays as it was, so each result is the same as
+ * from a job of its own. The sets are padded with empty ones, which never
+ * change, to a multiple of SEED_SET_LANES. */
+
+static int
+seed_set_lanes (int n_sets)
+{
+  return (n_sets + SEED_SET_LANES - 1) / SEED_SET_LANES * SEED_SET_LANES;
+}
+
+static size_t
+seed_sets_arena_size (int width, int height, int n_sets, const Options *options, int n_workers)
+{
+  size_t n_pixels = (size_t) width * height;
+
+  n_sets = seed_set_lanes (n_sets);
+  size_t element_size = precision_size (options->precision);
+  size_t temp_size = colour_arena_size (width, height) + arena_round (width * element_size);
+  size_t alpha_size = alpha_arena_size (width, height, options->soft_alpha_radius, n_workers);
+
+  if (options->precision != PRECISION_FP32)
+    temp_size += n_workers * row_scratch_size (width);
+
+  return weights_arena_size (width, height, options->precision)
+    + arena_round (n_pixels * n_sets * element_size) * 2
+    + iteration_arena_size (n_workers)
+    + (temp_size > alpha_size ? temp_size : alpha_size);
+}
+
+/* Solves the n_sets overlays against image and writes the results to
+ * output_paths. The overlays have had their headers read. Returns zero if
+ * the job was cancelled, with nothing written. */
+static int
+process_seed_sets (WorkerPool *pool, Arena *arena, Image *image, PngReader *overlay_readers,
+                   Image *overlays, int n_sets, const char * const *output_paths,
+                   const Options *options)
+{
+  size_t n_pixels = (size_t) image->width * image->height;
+  size_t element_size = precision_size (options->precision);
+  int n_lanes = seed_set_lanes (n_sets);
+  Checkpoint checkpoint;
+  PreprocessArgs pre;
+  IterationArgs args;
+  Layout layout;
+  char *weights, *seed_row;
+  size_t mark;
+  int x, y, k;
+  int cancelled;
+
+  weights = arena_alloc (arena, weights_arena_size (image->width, image->height, options->precision));
+
+  pre.image = image;
+  pre.overlay = NULL;
+  pre.precision = options->precision;
+  pre.image_array = (float *) weights;
+  pre.g_array = weights;
+  pre.overlay_array_a = arena_alloc (arena, n_pixels * n_lanes * element_size);
+  pre.overlay_array_b = arena_alloc (arena, n_pixels * n_lanes * element_size);
+  memset (pre.overlay_array_a, 0, n_pixels * n_lanes * element_size);
+
+  /* The interleaved sets are always in rows */
+  layout_init (&layout, image->width, image->height, 0, arena);
+  pre.layout = &layout;
+
+  iteration_args_init (&args, image, options, pool, arena);
+  args.n_sets = n_lanes;
+
+  mark = arena->used;
+  seed_row = arena_alloc (arena, image->width * element_size);
+
+  /* Each overlay is decoded where the weights will go and spread into its
+   * place among the sets */
+
+  for (k = 0; k < n_sets; k++)
+  {
+    png_reader_read (&overlay_readers [k], &overlays [k],
+                     image_rows_at (&overlays [k], weights + colour_arena_size (image->width, image->height)));
+
+    for (y = 0; y < image->height; y++)
+    {
+      char *seeds = pre.overlay_array_a + (size_t) y * image->width * n_lanes * element_size;
+
+      kernels->overlay_row_to_seeds [options->precision] (overlays [k].rows [y], seed_row, image->width);
+      for (x = 0; x < image->width; x++)
+        memcpy (seeds + ((size_t) x * n_lanes + k) * element_size, seed_row + x * element_size, element_size);
+    }
+
+    overlays [k].rows = NULL;
+  }
+
+  pre.blurred_array = arena_alloc (arena, colour_arena_size (image->width, image->height));
+  pre.row_scratch = NULL;
+  if (options->precision != PRECISION_FP32)
+    pre.row_scratch = arena_alloc (arena, pool->n_workers * row_scratch_size (image->width));
+
+  pool_run (pool, init_arrays_worker, &pre);
+  cancelled = job_cancelled (options->cancel);
+  if (!cancelled)
+  {
+    pool_run (pool, blur_worker, &pre);
+    cancelled = job_cancelled (options->cancel);
+  }
+  release_weights_for_numa (arena, weights, image, options);
+  if (!cancelled)
+    pool_run (pool, calc_g_worker, &pre);
+
+  arena_release (arena, (char *) seed_row, arena->used - mark);
+  arena->used = mark;
+
+  if (cancelled || job_cancelled (options->cancel))
+    return 0;
+
+  args.overlay_array_in = pre.overlay_array_a;
+  args.overlay_array_out = pre.overlay_array_b;
+  args.g_array = pre.g_array;
+
+  /* Only a batch checkpoints seed sets, when the job is preempted, so the
+   * checkpoint holds all the lanes and isn't keyed */
+  if (options->checkpoint_path)
+  {
+    checkpoint_init (&checkpoint, NULL, image, options);
+    checkpoint.element_size *= n_lanes;
+    if (options->resume)
+    {
+      int iterations = checkpoint_load (&checkpoint, pre.overlay_array_a);
+      args.iterations = iterations < 0 ? 0 : iterations;
+    }
+  }
+
+  solve_in_memory (pool, &args);
+  if (args.cancelled)
+  {
+    if (options->checkpoint_path && checkpoint_on_cancel (options))
+      checkpoint_save (&checkpoint, args.overlay_array_out, args.iterations);
+    return 0;
+  }
+
+  /* The other strength array is free now; each set's strengths are gathered
+   * there in turn to make its alpha */
+
+  for (k = 0; k < n_sets; k++)
+  {
+    const char *strengths = args.overlay_array_out;
+    char *strength = (char *) args.overlay_array_in;
+    size_t i;
+
+    for (i = 0; i < n_pixels; i++)
+      memcpy (strength + i * element_size, strengths + (i * n_lanes + k) * element_size, element_size);
+
+    arena->used = mark;
+    generate_alpha (pool, arena, image, strength, options->precision, options->soft_alpha_radius);
+    write_png_file (image, output_paths [k]);
+  }
+
+  if (options->checkpoint_path)
+    unlink (checkpoint.path);
+
+  return 1;
+}
+
+static const char *precision_names [] =
+{
+  [PRECISION_FP32] = "fp32",
+  [PRECISION_FP16] = "fp16",
+  [PRECISION_BF16] = "bf16"
+};
+
+static const char *affinity_names [] =
+{
+  [AFFINITY_NONE] = "none",
+  [AFFINITY_CORE] = "core",
+  [AFFINITY_SMT] = "smt"
+};
+
+/* Returns the affinity called name, or -1 if there's none */
+static int
+find_affinity (const char *name)
+{
+  int affinity;
+
+  for (affinity = AFFINITY_NONE; affinity <= AFFINITY_SMT; affinity++)
+  {
+    if (!strcmp (name, affinity_names [affinity]))
+      return affinity;
+  }
+
+  return -1;
+}
+
+/* Bytes of arena a job on a width x height image with n_sets overlays
+ * needs, including the decoded image */
+static size_t
+job_arena_size (int width, int height, int n_sets, const Options *options, int n_workers)
+{
+  return image_arena_size (width, height)
+    + (n_sets > 1 ? seed_sets_arena_size (width, height, n_sets, options, n_workers)
+                  : process_arena_size (width, height, options, n_workers));
+}
+
+/* Reports the storage picked for a job on image, which takes size bytes */
+static void
+report_fit (const Image *image, const Options *options, size_t size)
+{
+  char tiles [64] = "";
+
+  if (options->out_of_core)
+    snprintf (tiles, sizeof (tiles), " in %d-row tiles", out_of_core_tile_rows (image->width, options));
+
+  fprintf (stderr, "%dx%d image: %s %s%s, %zu MB, %s the limit of %zu MB%s\n",
+           image->width, image->height, precision_names [options->precision],
+           options->out_of_core ? "out of core" : "in memory", tiles, (size + (1 << 20) - 1) >> 20,
+           size <= options->mem_limit ? "within" : "over", options->mem_limit >> 20,
+           size <= options->mem_limit ? "" : "; nothing allowed is smaller, so it runs over it");
+}
+
+/* Picks the settings in options->fit for a job on image so its arena stays
+ * within options->mem_limit, and reports any change. The candidates are
+ * tried from fastest to smallest: as given, with the weights and strengths
+ * in fp16, which halves what the solver keeps, and out of core, which only
+ * keeps a band of rows, and both. Out of core, the tiles are made smaller
+ * until they fit. Several overlays can't be solved out of core. If none of
+ * them fits, the job isn't refused: the smallest is used, and the report
+ * says it's over the limit. */
+static void
+fit_memory_limit (const Image *image, int n_sets, int n_workers, Options *options)
+{
+  const struct { Precision precision; int out_of_core; int fit; } candidates [] =
+  {
+    { options->precision, options->out_of_core, 0 },
+    { PRECISION_FP16, options->out_of_core, FIT_PRECISION },
+    { options->precision, 1, FIT_OUT_OF_CORE },
+    { PRECISION_FP16, 1, FIT_PRECISION | FIT_OUT_OF_CORE }
+  };
+  Options candidate = *options, smallest = *options;
+  size_t size, smallest_size = 0;
+  int i, n_tried = 0;
+
+  for (i = 0; i < (int) (sizeof (candidates) / sizeof (candidates [0])); i++)
+  {
+    if ((candidates [i].fit & ~options->fit) || (candidates [i].out_of_core && n_sets > 1))
+      continue;
+
+    candidate = *options;
+    candidate.precision = candidates [i].precision;
+    candidate.out_of_core = candidates [i].out_of_core;
+    size = job_arena_size (image->width, image->height, n_sets, &candidate, n_workers);
+
+    while (candidate.out_of_core && size > options->mem_limit
+           && out_of_core_tile_rows (image->width, &candidate) > 1)
+    {
+      candidate.tile_bytes /= 2;
+      size = job_arena_size (image->width, image->height, n_sets, &candidate, n_workers);
+    }
+
+    if (size <= options->mem_limit)
+    {
+      *options = candidate;
+      if (i > 0)
+        report_fit (image, options, size);
+      return;
+    }
+
+    if (n_tried++ == 0 || size < smallest_size)
+    {
+      smallest = candidate;
+      smallest_size = size;
+    }
+  }
+
+  if (n_tried == 0)
+    return;
+
+  *options = smallest;
+  report_fit (image, options, smallest_size);
+}
+
+static void profile_apply (const Profile *profile, int width, int height, Options *options);
+
+/* Sets up *job_options, the pool and the kernels for a job on image with
+ * n_sets overlays. If a tuning profile is loaded, they're set as it says for
+ * the image size, and with a memory limit, the storage is picked to fit. */
+static void
+setup_job (WorkerPool **pool, const Image *image, int n_sets, const Options *options,
+           Options *job_options)
+{
+  *job_options = *options;
+
+  if (options->profile)
+    profile_apply (options->profile, image->width, image->height, job_options);
+
+  pool_ensure (pool, job_options);
+  kernels = select_kernel_set (job_options->isa);
+
+  if (options->mem_limit)
+    fit_memory_limit (image, n_sets, (*pool)->n_workers, job_options);
+}
+
+/* Decodes a job's inputs from the readers and processes them, leaving the
+ * result in *image. The readers have read the headers, so the arena can be
+ * sized for the whole job before any pixel data is decoded. If stats is
+ * given, it's filled in, with a newly allocated copy of the final
+ * strengths. Returns zero if the job was cancelled. */
+static int
+solve_decoded (WorkerPool **pool, Arena *arena, PngReader *image_reader, Image *image,
+               PngReader *overlay_reader, Image *overlay, const Options *options,
+               JobStats *stats)
+{
+  Options job_options;
+
+  setup_job (pool, image, 1, options, &job_options);
+
+  if (stats)
+  {
+    stats->strength = malloc ((size_t) image->width * image->height * sizeof (float));
+    if (!stats->strength)
+      abort_ ("Could not allocate strengths for the accuracy report");
+  }
+
+  arena_reset (arena,
+               job_arena_size (image->width, image->height, 1, &job_options, (*pool)->n_workers),
+               &job_options);
+
+  png_reader_read (image_reader, image, image_rows_alloc (image, arena));
+
+  /* The overlay is decoded into space that process_file () recycles once the
+   * seeds have been read from it */
+  return process_file (*pool, arena, image, overlay_reader, overlay, &job_options, stats);
+}
+
+/* Solves the overlays in overlay_paths against the image in image_path, and
+ * writes each result to the output path with the same index. Returns zero
+ * if the job was cancelled. */
+static int
+run_seed_sets (WorkerPool **pool, Arena *arena, const char *image_path, int n_sets,
+               const char * const *overlay_paths, const char * const *output_paths,
+               const Options *options)
+{
+  PngReader image_reader, overlay_readers [MAX_SEED_SETS];
+  Image image, overlays [MAX_SEED_SETS];
+  Options job_options;
+  int k;
+
+  if (n_sets > MAX_SEED_SETS)
+    abort_ ("At most %d overlays can be solved against one image", MAX_SEED_SETS);
+  if (options->out_of_core || options->accuracy_report || options->preview_path || options->cache_dir)
+    abort_ ("Several overlays can't be solved against one image with --out-of-core, "
+            "--accuracy-report, --preview or --cache-dir");
+
+  png_reader_open (&image_reader, image_path, &image);
+
+  for (k = 0; k < n_sets; k++)
+  {
+    png_reader_open (&overlay_readers [k], overlay_paths [k], &overlays [k]);
+
+    if (overlays [k].width != image.width || overlays [k].height != image.height)
+      abort_ ("Overlay %s is %dx%d but image %s is %dx%d", overlay_paths [k],
+              overlays [k].width, overlays [k].height, image_path, image.width, image.height);
+  }
+
+  setup_job (pool, &image, n_sets, options, &job_options);
+
+  arena_reset (arena,
+               job_arena_size (image.width, image.height, n_sets, &job_options, (*pool)->n_workers),
+               &job_options);
+
+  png_reader_read (&image_reader, &image, image_rows_alloc (&image, arena));
+
+  return process_seed_sets (*pool, arena, &image, overlay_readers, overlays, n_sets, output_paths,
+                            &job_options);
+}
+
+/* Like solve_decoded (), for a job's input files */
+static int
+solve_job (WorkerPool **pool, Arena *arena, const char *image_path, const char *overlay_path,
+           const Options *options, Image *image, JobStats *stats)
+{
+  PngReader image_reader, overlay_reader;
+  Image overlay;
+
+  png_reader_open (&image_reader, image_path, image);
+  png_reader_open (&overlay_reader, overlay_path, &overlay);
+
+  if (overlay.width != image->width || overlay.height != image->height)
+    abort_ ("Overlay %s is %dx%d but image %s is %dx%d", overlay_path,
+            overlay.width, overlay.height, image_path, image->width, image->height);
+
+  return solve_decoded (pool, arena, &image_reader, image, &overlay_reader, &overlay, options, stats);
+}
+
+/* Compares a result with the fp32 reference: how many pixels got the other
+ * label, and how far strengths and alpha are off */
+static void
+print_accuracy_report (const char *image_path, const Options *options, const Image *image,
+                       const JobStats *stats, const png_byte *reference_alpha,
+                       const JobStats *reference)
+{
+  size_t n_pixels = (size_t) image->width * image->height;
+  size_t n_flipped = 0, n_alpha_differ = 0;
+  double strength_sum = 0.0, alpha_sum = 0.0;
+  float strength_max = 0.0;
+  int alpha_max = 0;
+  int x, y;
+
+  for (y = 0; y < image->height; y++)
+  {
+    for (x = 0; x < image->width; x++)
+    {
+      size_t index = (size_t) y * image->width + x;
+      float a = stats->strength [index], b = reference->strength [index];
+      int alpha_diff = abs ((int) image->rows [y][x * 4 + 3] - (int) reference_alpha [index]);
+
+      n_flipped += (a > 0.0) != (b > 0.0);
+      strength_sum += fabsf (a - b);
+      strength_max = fabsf (a - b) > strength_max ? fabsf (a - b) : strength_max;
+      n_alpha_differ += alpha_diff != 0;
+      alpha_sum += alpha_diff;
+      alpha_max = alpha_diff > alpha_max ? alpha_diff : alpha_max;
+    }
+  }
+
+  fprintf (stderr,
+           "%s: %s compared with fp32\n"
+           "  iterations:       %d (fp32: %d)\n"
+           "  labels differing: %zu of %zu (%.4f%%)\n"
+           "  strength error:   max %.6f, mean %.6f\n"
+           "  alpha error:      max %d, mean %.6f (%zu pixels differ)\n",
+           image_path, precision_names [options->precision],
+           stats->iterations, reference->iterations,
+           n_flipped, n_pixels, 100.0 * n_flipped / n_pixels,
+           strength_max, strength_sum / n_pixels,
+           alpha_max, alpha_sum / n_pixels, n_alpha_differ);
+}
+
+/* Returns zero if the job was cancelled */
+static int
+run_job (WorkerPool **pool, Arena *arena, const char *image_path, const char *overlay_path,
+         const char *output_path, const Options *options)
+{
+  Options reference_options;
+  JobStats stats, reference;
+  png_byte *reference_alpha;
+  Image image;
+  int done;
+  int x, y;
+
+  if (!options->accuracy_report || options->precision == PRECISION_FP32)
+  {
+    if (!solve_job (pool, arena, image_path, overlay_path, options, &image, NULL))
+      return 0;
+    write_png_file (&image, output_path);
+    return 1;
+  }
+
+  /* Solve in fp32 first, and keep what we need from it for the comparison */
+
+  reference_options = *options;
+  reference_options.precision = PRECISION_FP32;
+  if (!solve_job (pool, arena, image_path, overlay_path, &reference_options, &image, &reference))
+  {
+    free (reference.strength);
+    return 0;
+  }
+
+  reference_alpha = malloc ((size_t) image.width * image.height);
+  if (!reference_alpha)
+    abort_ ("Could not allocate alpha for the accuracy report");
+
+  for (y = 0; y < image.height; y++)
+    for (x = 0; x < image.width; x++)
+      reference_alpha [(size_t) y * image.width + x] = image.rows [y][x * 4 + 3];
+
+  done = solve_job (pool, arena, image_path, overlay_path, options, &image, &stats);
+  if (done)
+  {
+    print_accuracy_report (image_path, options, &image, &stats, reference_alpha, &reference);
+    write_png_file (&image, output_path);
+  }
+
+  free (reference_alpha);
+  free (reference.strength);
+  free (stats.strength);
+  return done;
+}
+
+/* Runs a job given as an image followed by one or more pairs of overlay and
+ * output paths, which can be stopped through cancel. Returns 1 if it's done,
+ * 0 if it was cancelled, and -1 if the number of paths doesn't fit. */
+static int
+run_paths (WorkerPool **pool, Arena *arena, int n_paths, char * const *paths, const Options *options,
+           CancelToken *cancel)
+{
+  const char *overlay_paths [MAX_SEED_SETS], *output_paths [MAX_SEED_SETS];
+  int n_sets = (n_paths - 1) / 2;
+  Options job_options = *options;
+  int done;
+  int k;
+
+  if (n_paths < 3 || n_paths % 2 == 0 || n_sets > MAX_SEED_SETS)
+    return -1;
+
+  for (k = 0; k < n_sets; k++)
+  {
+    overlay_paths [k] = paths [1 + k * 2];
+    output_paths [k] = paths [2 + k * 2];
+  }
+
+  job_options.cancel = cancel;
+  current_cancel = cancel;
+
+  if (n_sets == 1)
+    done = run_job (pool, arena, paths [0], paths [1], paths [2], &job_options);
+  else
+    done = run_seed_sets (pool, arena, paths [0], n_sets, overlay_paths, output_paths, &job_options);
+
+  current_cancel = NULL;
+
+  if (!done && cancel_reason (cancel) != CANCEL_PREEMPTED)
+    fprintf (stderr, "%s: %s\n", paths [0],
+             cancel_reason (cancel) == CANCEL_DEADLINE ? "Deadline passed, job stopped" : "Job cancelled");
+
+  return done;
+}
+
+/* Batches
+ * -------
+ *
+ * --batch reads its job list on a thread of its own, so a front end can
+ * keep feeding it jobs on stdin while earlier ones run. Jobs are queued
+ * by priority class, then in the order they came in. A line starting with
+ * --priority=interactive gets ahead of the bulk jobs, and if a bulk job is
+ * running, it's preempted: it stops at the next iteration boundary, saves
+ * its strengths to a checkpoint in the scratch directory, and goes back to
+ * the front of its class to resume from there once the workers are free.
+ * Only a preempted job writes a checkpoint, and it's private to the job, so
+ * the others don't pay for hashing their input. Its deadline is paused
+ * while it waits. Without threads, the jobs run in the order they're
+ * listed. */
+
+typedef enum
+{
+  PRIORITY_BULK,
+  PRIORITY_INTERACTIVE
+}
+Priority;
+
+static const char *priority_names [] =
+{
+  [PRIORITY_BULK] = "bulk",
+  [PRIORITY_INTERACTIVE] = "interactive"
+};
+
+typedef struct BatchJob BatchJob;
+
+struct BatchJob
+{
+  BatchJob *next;
+  int line_no;
+  Priority priority;
+
+  /* Pointing into line */
+  char *line;
+  char *paths [MAX_SEED_SETS * 2 + 2];
+  int n_paths;
+
+  /* Where it saves its progress when preempted, whether it has been, and
+   * the seconds left before its deadline while it waits to resume */
+  char checkpoint_path [PATH_MAX];
+  int preempted;
+  double time_left;
+  CancelToken cancel;
+};
+
+typedef struct
+{
+  const char *file_name;
+  FILE *fp;
+  int line_no;
+  const Options *options;
+
+  /* Waiting jobs, most urgent first, and the one running */
+  BatchJob *queue;
+  BatchJob *running;
+  int eof;
+
+#ifdef WITH_THREADS
+  pthread_t reader;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+#endif
+}
+Batch;
+
+static Priority
+parse_priority (const char *value, const char *file_name, int line_no)
+{
+  Priority priority;
+
+  for (priority = PRIORITY_BULK; priority <= PRIORITY_INTERACTIVE; priority++)
+  {
+    if (!strcmp (value, priority_names [priority]))
+      return priority;
+  }
+
+  abort_ ("%s:%d: Invalid priority: %s", file_name, line_no, value);
+  return PRIORITY_BULK;
+}
+
+/* Reads the next job. Returns NULL at the end of the list. */
+static BatchJob *
+batch_read_job (Batch *batch)
+{
+  char line [16384];
+
+  while (fgets (line, sizeof (line), batch->fp))
+  {
+    BatchJob *job;
+    char *save, *path;
+
+    batch->line_no++;
+
+    if (!strchr (line, '\n') && !feof (batch->fp))
+      abort_ ("%s:%d: Line too long", batch->file_name, batch->line_no);
+
+    job = calloc (1, sizeof (BatchJob));
+    job->line = strdup (line);
+    job->line_no = batch->line_no;
+    job->priority = PRIORITY_BULK;
+
+    path = strtok_r (job->line, " \t\r\n", &save);
+
+    if (!path || path [0] == '#')
+    {
+      free (job->line);
+      free (job);
+      continue;
+    }
+
+    if (!strncmp (path, "--priority=", 11))
+    {
+      job->priority = parse_priority (path + 11, batch->file_name, batch->line_no);
+      path = strtok_r (NULL, " \t\r\n", &save);
+    }
+
+    for (job->n_paths = 0; path && job->n_paths < MAX_SEED_SETS * 2 + 2; job->n_paths++)
+    {
+      job->paths [job->n_paths] = path;
+      path = strtok_r (NULL, " \t\r\n", &save);
+    }
+
+    if (snprintf (job->checkpoint_path, sizeof (job->checkpoint_path), "%s/cropsicle-%d-%d.checkpoint",
+                  batch->options->scratch_dir, (int) getpid (), job->line_no)
+        >= (int) sizeof (job->checkpoint_path))
+      abort_ ("Scratch directory name too long: %s", batch->options->scratch_dir);
+
+    return job;
+  }
+
+  return NULL;
+}
+
+static void
+batch_job_free (BatchJob *job)
+{
+  free (job->line);
+  free (job);
+}
+
+/* Queues job behind those of the same priority that came in before it,
+ * preempting the running job if it's less urgent */
+static void
+batch_enqueue (Batch *batch, BatchJob *job)
+{
+  BatchJob **link = &batch->queue;
+
+  while (*link && ((*link)->priority > job->priority
+                   || ((*link)->priority == job->priority && (*link)->line_no < job->line_no)))
+    link = &(*link)->next;
+
+  job->next = *link;
+  *link = job;
+
+  if (batch->running && batch->running->priority < job->priority)
+    cancel_token_raise (&batch->running->cancel, CANCEL_PREEMPTED);
+}
+
+#ifdef WITH_THREADS
+
+static void *
+batch_reader_thread (Batch *batch)
+{
+  BatchJob *job;
+
+  while ((job = batch_read_job (batch)))
+  {
+    pthread_mutex_lock (&batch->mutex);
+    batch_enqueue (batch, job);
+    pthread_cond_signal (&batch->cond);
+    pthread_mutex_unlock (&batch->mutex);
+  }
+
+  pthread_mutex_lock (&batch->mutex);
+  batch->eof = 1;
+  pthread_cond_signal (&batch->cond);
+  pthread_mutex_unlock (&batch->mutex);
+
+  return NULL;
+}
+
+#endif
+
+/* Takes the most urgent job off the queue and marks it running. Returns
+ * NULL once the list is done. */
+static BatchJob *
+batch_next (Batch *batch)
+{
+  BatchJob *job;
+
+#ifdef WITH_THREADS
+  pthread_mutex_lock (&batch->mutex);
+
+  while (!batch->queue && !batch->eof)
+    pthread_cond_wait (&batch->cond, &batch->mutex);
+#else
+  if (!batch->queue && !batch->eof)
+  {
+    job = batch_read_job (batch);
+    if (job)
+      batch_enqueue (batch, job);
+    else
+      batch->eof = 1;
+  }
+#endif
+
+  job = batch->queue;
+  if (job)
+  {
+    batch->queue = job->next;
+
+    /* Armed before the mutex is released, so a job that comes in to
+     * preempt this one as soon as it's running finds it ready to be
+     * preempted. The deadline runs while the job runs, from when it first
+     * starts, and not while it waits after being preempted. */
+    if (!job->preempted)
+      cancel_token_init (&job->cancel, batch->options->deadline);
+    else
+    {
+      __atomic_store_n (&job->cancel.reason, CANCEL_NONE, __ATOMIC_RELEASE);
+      if (job->cancel.deadline > 0.0)
+        job->cancel.deadline = now () + job->time_left;
+    }
+  }
+  batch->running = job;
+
+#ifdef WITH_THREADS
+  pthread_mutex_unlock (&batch->mutex);
+#endif
+
+  return job;
+}
+
+/* Returns nonzero if no job is waiting to run */
+static int
+batch_idle (Batch *batch)
+{
+  int idle;
+
+#ifdef WITH_THREADS
+  pthread_mutex_lock (&batch->mutex);
+#endif
+
+  idle = !batch->queue;
+
+#ifdef WITH_THREADS
+  pthread_mutex_unlock (&batch->mutex);
+#endif
+
+  return idle;
+}
+
+/* Marks the running job as stopped, done or not. If it was preempted before
+ * it was done, it's put back in the queue, and nonzero is returned. */
+static int
+batch_job_stopped (Batch *batch, BatchJob *job, int done)
+{
+  int preempted;
+
+#ifdef WITH_THREADS
+  pthread_mutex_lock (&batch->mutex);
+#endif
+
+  batch->running = NULL;
+  preempted = !done && cancel_reason (&job->cancel) == CANCEL_PREEMPTED;
+
+  if (preempted)
+  {
+    job->preempted = 1;
+    job->time_left = job->cancel.deadline > 0.0 ? job->cancel.deadline - now () : 0.0;
+    batch_enqueue (batch, job);
+  }
+
+#ifdef WITH_THREADS
+  pthread_mutex_unlock (&batch->mutex);
+#endif
+
+  return preempted;
+}
+
+/* Runs the jobs listed in file_name, or stdin if it's "-". Each line holds
+ * the file names of a job separated by whitespace, as on the command line,
+ * optionally after a --priority. Blank lines and lines starting with '#'
+ * are skipped. Returns the number of jobs that were cancelled. */
+static int
+run_batch (WorkerPool **pool, Arena *arena, const char *file_name, const Options *options)
+{
+  Options job_options = *options;
+  int n_cancelled = 0;
+  BatchJob *job;
+  Batch batch;
+
+  memset (&batch, 0, sizeof (batch));
+  batch.file_name = file_name;
+  batch.options = options;
+  batch.fp = strcmp (file_name, "-") ? fopen (file_name, "r") : stdin;
+  if (!batch.fp)
+    abort_ ("File %s could not be opened for reading", file_name);
+
+#ifdef WITH_THREADS
+  pthread_mutex_init (&batch.mutex, NULL);
+  pthread_cond_init (&batch.cond, NULL);
+  pthread_create (&batch.reader, NULL, (void *(*)(void *)) batch_reader_thread, &batch);
+
+  job_options.checkpoint_on_preempt = 1;
+#endif
+
+  while ((job = batch_next (&batch)))
+  {
+    int done;
+
+#ifdef WITH_THREADS
+    job_options.checkpoint_path = job->checkpoint_path;
+    job_options.resume = job->preempted;
+#endif
+
+    done = run_paths (pool, arena, job->n_paths, job->paths, &job_options, &job->cancel);
+    if (done < 0)
+      abort_ ("%s:%d: Expected <image_in> <overlay_in> <image_out> [<overlay_in> <image_out> ...]",
+              file_name, job->line_no);
+
+    if (batch_job_stopped (&batch, job, done))
+    {
+      fprintf (stderr, "%s: Preempted\n", job->paths [0]);
+      continue;
+    }
+
+    /* A finished job removes its checkpoint, but a cancelled one leaves it */
+    if (!done)
+    {
+      unlink (job->checkpoint_path);
+      n_cancelled++;
+    }
+
+    batch_job_free (job);
+
+    /* An idle batch holds none of the budget */
+    if (options->mem_budget && batch_idle (&batch))
+      arena_free (arena, options);
+  }
+
+#ifdef WITH_THREADS
+  pthread_join (batch.reader, NULL);
+  pthread_mutex_destroy (&batch.mutex);
+  pthread_cond_destroy (&batch.cond);
+#endif
+
+  if (batch.fp != stdin)
+    fclose (batch.fp);
+
+  return n_cancelled;
+}
+
+/* Tuning profiles
+ * ---------------
+ *
+ * The fastest thread count, kernel set and CPU affinity depend on the
+ * machine and on the size of the image. --tune times the candidates on
+ * synthetic jobs of a few sizes and writes the winners to a profile, which
+ * later runs load to set those options for each job by its size. The
+ * profile is a text file with one line per size class, smallest first:
+ *
+ *   <max pixels> <threads> <isa> <affinity>
+ *
+ * with max pixels 0 on the last line, which takes all larger images. Lines
+ * starting with '#' are comments. Profiles without the affinity are from
+ * before it was tuned, and leave the workers unpinned. Profiles from older
+ * versions have a strip width there instead; they're ignored with a
+ * warning. Options given on the command line win over the profile, and are
+ * left alone when tuning.
+ *
+ * Whether pinning a worker to each core beats letting workers share cores,
+ * or letting the scheduler place them, depends on how many cores there are
+ * and how the memory bandwidth is shared between them, so --tune times all
+ * three rather than assuming one. */
+
+#define N_TUNE_SIZES 3
+
+/* Default profile, in $HOME */
+#define PROFILE_NAME ".cropsicle-profile"
+
+/* Settings a profile can choose */
+#define TUNE_THREADS  (1 << 0)
+#define TUNE_ISA      (1 << 1)
+#define TUNE_AFFINITY (1 << 2)
+
+/* Percent by which pinning the workers must beat leaving them to the
+ * scheduler to be chosen; pinned workers can't make way for other load */
+#define TUNE_PIN_MARGIN 3
+
+/* Size of each class's synthetic job; the boundaries between classes are
+ * halfway between them on a log scale */
+static const int tune_sizes [N_TUNE_SIZES] [2] =
+{
+  { 256, 256 },
+  { 768, 512 },
+  { 1536, 1024 }
+};
+
+typedef struct
+{
+  size_t max_pixels;
+  int n_threads;
+  const char *isa;
+  Affinity affinity;
+}
+ProfileEntry;
+
+struct Profile
+{
+  ProfileEntry entries [N_TUNE_SIZES];
+  int n_entries;
+
+  /* TUNE_* flags of the settings the profile may change */
+  int tunable;
+};
+
+static void
+profile_apply (const Profile *profile, int width, int height, Options *options)
+{
+  const ProfileEntry *entry;
+  int i;
+
+  for (i = 0; i < profile->n_entries - 1; i++)
+  {
+    if ((size_t) width * height <= profile->entries [i].max_pixels)
+      break;
+  }
+
+  entry = &profile->entries [i];
+
+  if (profile->tunable & TUNE_THREADS)
+    options->n_threads = entry->n_threads;
+  if (profile->tunable & TUNE_ISA)
+    options->isa = entry->isa;
+  if (profile->tunable & TUNE_AFFINITY)
+    options->affinity = entry->affinity;
+}
+
+/* Loads the profile in file_name. Returns zero if there is no such file, or
+ * if the profile was made on a CPU with other instruction sets, in which case
+ * it's ignored with a warning. */
+static int
+profile_load (Profile *profile, const char *file_name)
+{
+  char line [256];
+  int line_no = 0;
+  FILE *fp;
+
+  fp = fopen (file_name, "r");
+  if (!fp)
+  {
+    if (errno == ENOENT)
+      return 0;
+    abort_ ("File %s could not be opened for reading", file_name);
+  }
+
+  memset (profile, 0, sizeof (Profile));
+
+  while (fgets (line, sizeof (line), fp))
+  {
+    ProfileEntry *entry = &profile->entries [profile->n_entries];
+    unsigned long max_pixels;
+    char isa [32], affinity [32];
+    int i, n, m;
+
+    line_no++;
+
+    n = strspn (line, " \t\r\n");
+    if (line [n] == '\0' || line [n] == '#')
+      continue;
+
+    if (profile->n_entries == N_TUNE_SIZES
+        || sscanf (line, "%lu %d %31s %n", &max_pixels, &entry->n_threads, isa, &n) != 3
+        || entry->n_threads < 1
+        || (profile->n_entries > 0
+            && (profile->entries [profile->n_entries - 1].max_pixels == 0
+                || (max_pixels != 0 && max_pixels <= profile->entries [profile->n_entries - 1].max_pixels))))
+      abort_ ("%s:%d: Invalid profile entry", file_name, line_no);
+
+    if (line [n] >= '0' && line [n] <= '9')
+    {
+      fprintf (stderr, "%s: Ignoring profile with strip widths from an older version; "
+               "run --tune to make a new one\n", file_name);
+      fclose (fp);
+      return 0;
+    }
+
+    entry->affinity = AFFINITY_NONE;
+    if (line [n] != '\0')
+    {
+      if (sscanf (line + n, "%31s %n", affinity, &m) != 1 || line [n + m] != '\0'
+          || find_affinity (affinity) < 0)
+        abort_ ("%s:%d: Invalid profile entry", file_name, line_no);
+
+      entry->affinity = find_affinity (affinity);
+    }
+
+    entry->max_pixels = max_pixels;
+
+    for (i = 0; i < N_KERNEL_SETS; i++)
+    {
+      if (!strcmp (isa, kernel_sets [i]->name) && cpu_supports_kernel_set (kernel_sets [i]))
+        entry->isa = kernel_sets [i]->name;
+    }
+
+    if (!entry->isa)
+    {
+      fprintf (stderr, "%s: Ignoring profile for another CPU (%s is not supported); "
+               "run --tune to make a new one\n", file_name, isa);
+      fclose (fp);
+      return 0;
+    }
+
+    profile->n_entries++;
+  }
+
+  fclose (fp);
+
+  if (profile->n_entries == 0 || profile->entries [profile->n_entries - 1].max_pixels != 0)
+    abort_ ("%s: Profile must end with a size class of max pixels 0", file_name);
+
+  return 1;
+}
+
+static void
+profile_save (const Profile *profile, const char *file_name)
+{
+  FILE *fp;
+  int i;
+
+  fp = fopen (file_name, "w");
+  if (!fp)
+    abort_ ("File %s could not be opened for writing", file_name);
+
+  fprintf (fp, "# Written by cropsicle --tune\n"
+           "# <max pixels> <threads> <isa> <affinity>\n");
+
+  for (i = 0; i < profile->n_entries; i++)
+  {
+    const ProfileEntry *entry = &profile->entries [i];
+
+    fprintf (fp, "%zu %d %s %s\n", entry->max_pixels, entry->n_threads, entry->isa,
+             affinity_names [entry->affinity]);
+  }
+
+  if (fclose (fp) != 0)
+    abort_ ("Error writing %s", file_name);
+}
+
+/* Makes a job that looks like a typical one: a disc in front of a
+ * background, both with a gradient and some noise, with a stroke of
+ * foreground seeds across the disc and background seeds around the edge.
+ * The same size always gives the same job. */
+static void
+synthesize_job (Image *image, Image *overlay, int width, int height)
+{
+  float cx = width * 0.5f, cy = height * 0.5f;
+  float radius = (width < height ? width : height) * 0.35f;
+  uint32_t state = 2463534242u;
+  Image *images [2];
+  int x, y, i;
+
+  images [0] = image;
+  images [1] = overlay;
+
+  for (i = 0; i < 2; i++)
+  {
+    png_byte *pixels;
+
+    images [i]->width = width;
+    images [i]->height = height;
+    images [i]->color_type = PNG_COLOR_TYPE_RGBA;
+    images [i]->bit_depth = 8;
+
+    images [i]->rows = malloc (height * sizeof (png_bytep));
+    pixels = calloc ((size_t) width * height, 4);
+    if (!images [i]->rows || !pixels)
+      abort_ ("Could not allocate memory for tuning");
+
+    for (y = 0; y < height; y++)
+      images [i]->rows [y] = pixels + (size_t) y * width * 4;
+  }
+
+  for (y = 0; y < height; y++)
+  {
+    for (x = 0; x < width; x++)
+    {
+      png_byte *pixel = image->rows [y] + x * 4;
+      png_byte *seed = overlay->rows [y] + x * 4;
+      float dx = x - cx, dy = y - cy;
+      int inside = dx * dx + dy * dy < radius * radius;
+      int shade = (x + y) * 64 / (width + height);
+
+      state ^= state << 13;
+      state ^= state >> 17;
+      state ^= state << 5;
+
+      pixel [0] = (inside ? 180 : 40) + shade + (state & 15);
+      pixel [1] = (inside ? 120 : 90) + shade + ((state >> 4) & 15);
+      pixel [2] = (inside ? 60 : 150) + shade + ((state >> 8) & 15);
+      pixel [3] = 0xff;
+
+      if (fabsf (dy) < 2.0f && fabsf (dx) < radius * 0.5f)
+      {
+        seed [1] = 0xff;
+        seed [3] = 0xff;
+      }
+      else if (x < 2 || y < 2 || x >= width - 2 || y >= height - 2)
+      {
+        seed [0] = 0xff;
+        seed [3] = 0xff;
+      }
+    }
+  }
+}
+
+/* Returns the best time of a few runs of the job with options */
+static double
+time_job (WorkerPool **pool, Arena *arena, const Image *image, const Image *overlay,
+          const Options *options)
+{
+  double best = 0.0;
+  int i;
+
+  for (i = 0; i < 2; i++)
+  {
+    PngReader image_reader, overlay_reader;
+    Image result, seeds;
+    double start;
+
+    png_reader_open_image (&image_reader, image, &result);
+    png_reader_open_image (&overlay_reader, overlay, &seeds);
+
+    start = now ();
+    solve_decoded (pool, arena, &image_reader, &result, &overlay_reader, &seeds, options, NULL);
+
+    if (i == 0 || now () - start < best)
+      best = now () - start;
+  }
+
+  return best;
+}
+
+/* Copies the path of the process' cgroup v2, relative to CGROUP_ROOT and
+ * without a trailing slash, to path. Returns zero if it isn't in one. */
+static int
+cgroup_path (char *path, size_t size)
+{
+  char line [PATH_MAX + 8];
+  int found = 0;
+  FILE *fp;
+
+  fp = fopen ("/proc/self/cgroup", "r");
+  if (!fp)
+    return 0;
+
+  while (!found && fgets (line, sizeof (line), fp))
+  {
+    if (strncmp (line, "0::", 3))
+      continue;
+
+    line [strcspn (line, "\n")] = '\0';
+    found = snprintf (path, size, "%s", strcmp (line + 3, "/") ? line + 3 : "") < (int) size;
+  }
+
+  fclose (fp);
+  return found;
+}
+
+/* Returns the lowest limit in the file name of the process' cgroup and its
+ * ancestors, or 0 if none of them sets one. The files hold "max" for no
+ * limit, or a number, which in cpu.max is a quota divided by the period
+ * that follows it. */
+static double
+cgroup_limit (const char *name)
+{
+  char path [PATH_MAX], file [PATH_MAX + 64];
+  double limit = 0.0;
+
+  if (!cgroup_path (path, sizeof (path)))
+    return 0.0;
+
+  for (;;)
+  {
+    char value [32];
+    double period = 1.0;
+    FILE *fp;
+
+    snprintf (file, sizeof (file), "%s%s/%s", CGROUP_ROOT, path, name);
+    fp = fopen (file, "r");
+
+    if (fp && fscanf (fp, "%31s %lf", value, &period) >= 1 && strcmp (value, "max") && period > 0.0)
+    {
+      double v = strtod (value, NULL) / period;
+
+      if (v > 0.0 && (limit == 0.0 || v < limit))
+        limit = v;
+    }
+
+    if (fp)
+      fclose (fp);
+
+    if (!path [0])
+      break;
+    *strrchr (path, '/') = '\0';
+  }
+
+  return limit;
+}
+
+/* CPUs the process may use, which in a cgroup with a CPU quota is the
+ * quota. A fraction of a CPU is left out; a worker on it would keep being
+ * throttled, and hold up the others at each iteration. */
+static int
+count_usable_cpus (void)
+{
+  double quota = cgroup_limit ("cpu.max");
+  int n_cpus = 1;
+
+#ifdef WITH_THREADS
+  cpu_set_t allowed;
+
+  if (sched_getaffinity (0, sizeof (allowed), &allowed) == 0)
+    n_cpus = CPU_COUNT (&allowed);
+#endif
+
+  if (quota > 0.0 && quota < n_cpus)
+    n_cpus = quota >= 1.0 ? (int) quota : 1;
+
+  return n_cpus;
+}
+
+/* Tries each value of one setting in turn, keeping the others as they are
+ * in *best, and leaves the fastest in *best. Returns its time. */
+static double
+tune_setting (WorkerPool **pool, Arena *arena, const Image *image, const Image *overlay,
+              Options *best, double best_time, int *setting, const int *values, int n_values,
+              const char *name)
+{
+  int best_value = *setting;
+  int i;
+
+  for (i = 0; i < n_values; i++)
+  {
+    double t;
+
+    if (values [i] == best_value)
+      continue;
+
+    *setting = values [i];
+    t = time_job (pool, arena, image, overlay, best);
+    fprintf (stderr, "  %s=%d: %.3f s\n", name, values [i], t);
+
+    if (t < best_time)
+    {
+      best_time = t;
+      best_value = values [i];
+    }
+  }
+
+  *setting = best_value;
+  return best_time;
+}
+
+/* Times each size class with the settings in tunable varied one at a time,
+ * starting from options, and saves the winners as a profile */
+static void
+tune (WorkerPool **pool, Arena *arena, const Options *options, int tunable, const char *file_name)
+{
+  Profile profile;
+  int n_cpus = count_usable_cpus ();
+  int i;
+
+  memset (&profile, 0, sizeof (profile));
+
+  for (i = 0; i < N_TUNE_SIZES; i++)
+  {
+    int width = tune_sizes [i] [0], height = tune_sizes [i] [1];
+    ProfileEntry *entry = &profile.entries [i];
+    Options best = *options;
+    Image image, overlay;
+    int values [32];
+    int n_values, k;
+    double best_time;
+
+    synthesize_job (&image, &overlay, width, height);
+
+    best.profile = NULL;
+    best.cache_dir = NULL;
+    best.preview_path = NULL;
+    best.mem_limit = 0;
+    best.isa = select_kernel_set (options->isa)->name;
+
+    fprintf (stderr, "Tuning %dx%d\n", width, height);
+    best_time = time_job (pool, arena, &image, &overlay, &best);
+    fprintf (stderr, "  threads=%d isa=%s affinity=%s: %.3f s\n", best.n_threads, best.isa,
+             affinity_names [best.affinity], best_time);
+
+    if (tunable & TUNE_ISA)
+    {
+      const char *best_isa = best.isa;
+
+      for (k = 0; k < N_KERNEL_SETS; k++)
+      {
+        double t;
+
+        if (!cpu_supports_kernel_set (kernel_sets [k]) || kernel_sets [k]->name == best_isa)
+          continue;
+
+        best.isa = kernel_sets [k]->name;
+        t = time_job (pool, arena, &image, &overlay, &best);
+        fprintf (stderr, "  isa=%s: %.3f s\n", best.isa, t);
+
+        if (t < best_time)
+        {
+          best_time = t;
+          best_isa = best.isa;
+        }
+      }
+
+      best.isa = best_isa;
+    }
+
+    if (tunable & TUNE_THREADS)
+    {
+      for (n_values = 0, k = 1; k < n_cpus && n_values < 31; k *= 2)
+        values [n_values++] = k;
+      values [n_values++] = n_cpus;
+
+      best_time = tune_setting (pool, arena, &image, &overlay, &best, best_time,
+                                &best.n_threads, values, n_values, "threads");
+    }
+
+#ifdef WITH_THREADS
+    /* With the number of workers settled, as placing them matters more the
+     * more of them there are. They start out unpinned, as --affinity isn't
+     * tuned if it's given. On one CPU there's nothing to place. */
+    if ((tunable & TUNE_AFFINITY) && n_cpus > 1)
+    {
+      Affinity best_affinity = AFFINITY_NONE;
+      double unpinned_time = best_time;
+      Affinity affinity;
+
+      for (affinity = AFFINITY_CORE; affinity <= AFFINITY_SMT; affinity++)
+      {
+        double t;
+
+        best.affinity = affinity;
+        t = time_job (pool, arena, &image, &overlay, &best);
+        fprintf (stderr, "  affinity=%s: %.3f s\n", affinity_names [affinity], t);
+
+        if (t < best_time && t * (100 + TUNE_PIN_MARGIN) / 100 < unpinned_time)
+        {
+          best_time = t;
+          best_affinity = affinity;
+        }
+      }
+
+      best.affinity = best_affinity;
+    }
+#endif
+
+    entry->n_threads = best.n_threads;
+    entry->isa = best.isa;
+    entry->affinity = best.affinity;
+    entry->max_pixels = i == N_TUNE_SIZES - 1 ? 0 :
+      sqrt ((double) width * height * tune_sizes [i + 1] [0] * tune_sizes [i + 1] [1]);
+    profile.n_entries++;
+
+    fprintf (stderr, "  best: threads=%d isa=%s affinity=%s (%.3f s)\n", entry->n_threads, entry->isa,
+             affinity_names [entry->affinity], best_time);
+
+    free (image.rows [0]);
+    free (image.rows);
+    free (overlay.rows [0]);
+    free (overlay.rows);
+  }
+
+  profile_save (&profile, file_name);
+  fprintf (stderr, "Wrote %s\n", file_name);
+}
+
+static int
+parse_int_option (const char *name, const char *value, int min)
+{
+  char *end;
+  long n;
+
+  n = strtol (value, &end, 10);
+  if (*value == '\0' || *end != '\0' || n < min || n > 1 << 20)
+    abort_ ("Invalid value for --%s: %s", name, value);
+
+  return n;
+}
+
+static AllocMode
+parse_alloc_mode (const char *value)
+{
+  if (!strcmp (value, "malloc"))
+    return ALLOC_MALLOC;
+  if (!strcmp (value, "thp"))
+    return ALLOC_THP;
+  if (!strcmp (value, "hugetlb"))
+    return ALLOC_HUGETLB;
+  if (!strcmp (value, "file"))
+    return ALLOC_FILE;
+
+  abort_ ("Invalid value for --alloc: %s", value);
+  return ALLOC_MALLOC;
+}
+
+static Affinity
+parse_affinity (const char *value)
+{
+  int affinity = find_affinity (value);
+
+  if (affinity < 0)
+    abort_ ("Invalid value for --affinity: %s", value);
+
+  return affinity;
+}
+
+static Precision
+parse_precision (const char *value)
+{
+  Precision precision;
+
+  for (precision = PRECISION_FP32; precision <= PRECISION_BF16; precision++)
+  {
+    if (!strcmp (value, precision_names [precision]))
+      return precision;
+  }
+
+  abort_ ("Invalid value for --precision: %s", value);
+  return PRECISION_FP32;
+}
+
+static void
+usage (const char *prog_name)
+{
+  abort_ ("Usage: %s [options] <image_in> <overlay_in> <image_out> [<overlay_in> <image_out> ...]\n"
+          "       %s [options] --batch=FILE\n"
+          "       %s [options] --tune\n"
+          "\n"
+          "Options:\n"
+          "  --batch=FILE          Run the jobs listed in FILE (- for stdin), one per line\n"
+          "  --soft-alpha=RADIUS   Estimate soft alpha within RADIUS pixels of the boundary\n"
+          "  --out-of-core         Keep solver arrays in a scratch file instead of memory\n"
+          "  --scratch-dir=DIR     Directory for scratch files (default: $TMPDIR or /tmp)\n"
+          "  --alloc=MODE          Back solver arrays with malloc (default), thp, hugetlb or file\n"
+          "  --threads=N           Number of worker threads (default: %d, or the cgroup's CPU quota)\n"
+          "  --numa                Pin workers to NUMA nodes, each owning a block of rows\n"
+          "  --affinity=MODE       Pin workers to CPUs: none (default), core or smt\n"
+          "  --block-size=N        Store solver arrays in N x N blocks, N a power of two\n"
+          "  --precision=FORMAT    Store weights and strengths as fp32 (default), fp16 or bf16\n"
+          "  --accuracy-report     Also solve in fp32 and report how far the result is off\n"
+          "  --isa=ISA             Use kernels for auto (default), generic, sse4.2, avx2 or avx512\n"
+          "  --tune                Find the fastest settings for this machine and save a profile\n"
+          "  --profile=FILE        Profile to save or use (default: $HOME/%s)\n"
+          "  --cache-dir=DIR       Reuse results and weights of earlier jobs, kept in DIR\n"
+          "  --cache-size=MB       Remove least recently used entries past MB (default: %d)\n"
+          "  --checkpoint=FILE     Save solver progress to FILE while solving\n"
+          "  --checkpoint-interval=SECONDS\n"
+          "                        Seconds between saves to the checkpoint (default: %d)\n"
+          "  --resume              Continue from the checkpoint if there is one\n"
+          "  --preview=FILE        Write a scaled-down mask of the labels to FILE while solving\n"
+          "  --preview-interval=SECONDS\n"
+          "                        Seconds between previews (default: %d)\n"
+          "  --preview-iterations=N\n"
+          "                        Write a preview every N iterations instead\n"
+          "  --deadline=SECONDS    Stop each job that takes longer than SECONDS\n"
+          "  --mem-budget=MB       Wait for jobs in all processes to fit in MB together\n"
+          "  --mem-limit=MB        Pick the storage of each job to fit in MB",
+          prog_name, prog_name, prog_name, N_THREADS, PROFILE_NAME,
+          CACHE_SIZE_MB, CHECKPOINT_INTERVAL, PREVIEW_INTERVAL);
+}
+
+int
+main (int argc, char **argv)
+{
+  static const struct option long_options [] =
+  {
+    { "soft-alpha", required_argument, NULL, 's' },
+    { "out-of-core", no_argument, NULL, 'o' },
+    { "scratch-dir", required_argument, NULL, 'd' },
+    { "alloc", required_argument, NULL, 'a' },
+    { "threads", required_argument, NULL, 't' },
+    { "numa", no_argument, NULL, 'n' },
+    { "affinity", required_argument, NULL, 'f' },
+    { "block-size", required_argument, NULL, 'B' },
+    { "batch", required_argument, NULL, 'b' },
+    { "precision", required_argument, NULL, 'p' },
+    { "accuracy-report", no_argument, NULL, 'r' },
+    { "isa", required_argument, NULL, 'i' },
+    { "tune", no_argument, NULL, 'T' },
+    { "profile", required_argument, NULL, 'P' },
+    { "cache-dir", required_argument, NULL, 'C' },
+    { "cache-size", required_argument, NULL, 'Z' },
+    { "checkpoint", required_argument, NULL, 'K' },
+    { "checkpoint-interval", required_argument, NULL, 'I' },
+    { "resume", no_argument, NULL, 'R' },
+    { "preview", required_argument, NULL, 'V' },
+    { "preview-interval", required_argument, NULL, 'v' },
+    { "preview-iterations", required_argument, NULL, 'N' },
+    { "deadline", required_argument, NULL, 'D' },
+    { "mem-budget", required_argument, NULL, 'M' },
+    { "mem-limit", required_argument, NULL, 'L' },
+    { NULL, 0, NULL, 0 }
+  };
+  const char *batch_file = NULL;
+  const char *profile_file = NULL;
+  int tunable = TUNE_THREADS | TUNE_ISA | TUNE_AFFINITY;
+  int tuning = 0;
+  int n_cancelled = 0;
+  struct sigaction action;
+  Options options;
+  Profile profile;
+  WorkerPool *pool;
+  Arena arena;
+  size_t cgroup_memory;
+  int c;
+
+  memset (&options, 0, sizeof (options));
+  options.scratch_dir = getenv ("TMPDIR") ? getenv ("TMPDIR") : "/tmp";
+  options.tile_bytes = OUT_OF_CORE_TILE_BYTES;
+  options.n_threads = N_THREADS;
+  options.cache_size = (size_t) CACHE_SIZE_MB << 20;
+  options.checkpoint_interval = CHECKPOINT_INTERVAL;
+  options.preview_interval = PREVIEW_INTERVAL;
+  options.fit = FIT_PRECISION | FIT_OUT_OF_CORE;
+
+  /* In a container, the defaults follow the limits of its cgroup */
+  if (cgroup_limit ("cpu.max") > 0.0)
+    options.n_threads = count_usable_cpus ();
+  cgroup_memory = (size_t) (cgroup_limit ("memory.max") * CGROUP_MEMORY_SHARE / 100);
+
+  while ((c = getopt_long (argc, argv, "", long_options, NULL)) != -1)
+  {
+    switch (c)
+    {
+      case 's':
+        options.soft_alpha_radius = parse_int_option ("soft-alpha", optarg, 1);
+        break;
+      case 'o':
+        options.out_of_core = 1;
+        options.fit &= ~FIT_OUT_OF_CORE;
+        break;
+      case 'd':
+        options.scratch_dir = optarg;
+        break;
+      case 'a':
+        options.alloc_mode = parse_alloc_mode (optarg);
+        break;
+      case 't':
+        options.n_threads = parse_int_option ("threads", optarg, 1);
+        tunable &= ~TUNE_THREADS;
+        break;
+      case 'n':
+        options.numa = 1;
+        break;
+      case 'f':
+        options.affinity = parse_affinity (optarg);
+        tunable &= ~TUNE_AFFINITY;
+        break;
+      case 'B':
+        options.block_size = parse_int_option ("block-size", optarg, 0);
+        if (options.block_size & (options.block_size - 1))
+          abort_ ("--block-size must be a power of two: %s", optarg);
+        break;
+      case 'b':
+        batch_file = optarg;
+        break;
+      case 'p':
+        options.precision = parse_precision (optarg);
+        options.fit &= ~FIT_PRECISION;
+        break;
+      case 'r':
+        options.accuracy_report = 1;
+        options.fit &= ~FIT_PRECISION;
+        break;
+      case 'i':
+        options.isa = strcmp (optarg, "auto") ? optarg : NULL;
+        tunable &= ~TUNE_ISA;
+        break;
+      case 'T':
+        tuning = 1;
+        break;
+      case 'P':
+        profile_file = optarg;
+        break;
+      case 'C':
+        options.cache_dir = optarg;
+        break;
+      case 'Z':
+        options.cache_size = (size_t) parse_int_option ("cache-size", optarg, 1) << 20;
+        break;
+      case 'K':
+        options.checkpoint_path = optarg;
+        break;
+      case 'I':
+        options.checkpoint_interval = parse_int_option ("checkpoint-interval", optarg, 1);
+        break;
+      case 'R':
+        options.resume = 1;
+        break;
+      case 'V':
+        options.preview_path = optarg;
+        break;
+      case 'v':
+        options.preview_interval = parse_int_option ("preview-interval", optarg, 1);
+        break;
+      case 'N':
+        options.preview_iterations = parse_int_option ("preview-iterations", optarg, 1);
+        break;
+      case 'D':
+        options.deadline = parse_int_option ("deadline", optarg, 1);
+        break;
+      case 'M':
+        options.mem_budget = (size_t) parse_int_option ("mem-budget", optarg, 1) << 20;
+        break;
+      case 'L':
+        options.mem_limit = (size_t) parse_int_option ("mem-limit", optarg, 1) << 20;
+        break;
+      default:
+        usage (argv [0]);
+    }
+  }
+
+  if ((batch_file || tuning ? argc != optind : argc - optind < 3) || (batch_file && tuning))
+    usage (argv [0]);
+
+  /* The cgroup's memory limit only lets a job go out of core, which gives
+   * the same result, never fp16, which doesn't */
+  if (!options.mem_limit && cgroup_memory)
+  {
+    options.mem_limit = cgroup_memory;
+    options.fit &= FIT_OUT_OF_CORE;
+  }
+
+  /* A checkpoint belongs to a single job */
+  if ((options.resume && !options.checkpoint_path)
+      || (options.checkpoint_path && (batch_file || tuning || argc - optind != 3)))
+    usage (argv [0]);
+
+  /* Fail early on an unsupported --isa */
+  select_kernel_set (options.isa);
+
+  if (options.cache_dir && mkdir (options.cache_dir, 0755) != 0 && errno != EEXIST)
+    abort_ ("Could not create cache directory %s: %s", options.cache_dir, strerror (errno));
+
+  if (!profile_file && getenv ("HOME"))
+  {
+    static char default_profile [PATH_MAX];
+
+    snprintf (default_profile, sizeof (default_profile), "%s/%s", getenv ("HOME"), PROFILE_NAME);
+    profile_file = default_profile;
+  }
+
+  if (!tuning && profile_file && profile_load (&profile, profile_file))
+  {
+    profile.tunable = tunable;
+    options.profile = &profile;
+  }
+
+  /* SIGUSR1 stops the job in progress */
+  memset (&action, 0, sizeof (action));
+  action.sa_handler = cancel_signal_handler;
+  action.sa_flags = SA_RESTART;
+  sigemptyset (&action.sa_mask);
+  sigaction (SIGUSR1, &action, NULL);
+
+  /* The pool and the arena outlive the jobs */
+
+  pool = pool_new (&options);
+  memset (&arena, 0, sizeof (arena));
+
+  if (tuning)
+  {
+    if (!profile_file)
+      abort_ ("No profile file given, and $HOME is not set");
+    tune (&pool, &arena, &options, tunable, profile_file);
+  }
+  else if (batch_file)
+    n_cancelled = run_batch (&pool, &arena, batch_file, &options);
+  else
+  {
+    CancelToken cancel;
+    int done;
+
+    cancel_token_init (&cancel, options.deadline);
+    done = run_paths (&pool, &arena, argc - optind, argv + optind, &options, &cancel);
+
+    if (done < 0)
+      usage (argv [0]);
+    n_cancelled = !done;
+  }
+
+  arena_free (&arena, &options);
+  pool_free (pool);
+
+  return n_cancelled > 0;
 }